@@ -1,8 +1,26 @@
 
 #define _USE_MATH_DEFINES
+// fopen and friends are fine here, /sdl would reject them otherwise
+#define _CRT_SECURE_NO_WARNINGS
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <assert.h>
+#include <stddef.h>
+#include <float.h>
+#include <signal.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 #if defined(__APPLE__)
 #include <GLUT/GLUT.h>
@@ -14,10 +32,33 @@
 #endif
 #include <GL/glew.h>		 
 #include <GL/freeglut.h>	
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+#include <GL/glx.h>
+#endif
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+#include <direct.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
 #endif
 
 #include <string>
 #include <vector>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <type_traits>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
 
 unsigned int windowWidth = 800, windowHeight = 800;
 unsigned char keyPressed[256];
@@ -42,7 +83,7 @@ void getErrorInfo(unsigned int handle)
 }
 
 // check if shader could be compiled
-void checkShader(unsigned int shader, char * message)
+void checkShader(unsigned int shader, const char * message)
 {
 	int OK;
 	glGetShaderiv(shader, GL_COMPILE_STATUS, &OK);
@@ -65,6 +106,134 @@ void checkLinking(unsigned int program)
 	}
 }
 
+// scoped timing for a trace viewer: PROFILE_SCOPE("name") records when the
+// enclosing block starts and ends. Each thread writes its own ring buffer
+// without locking, the oldest events are overwritten once it is full.
+// Build with PROFILING=0 to compile the scopes out.
+#ifndef PROFILING
+#define PROFILING 1
+#endif
+
+class Profiler
+{
+public:
+	struct Event
+	{
+		const char* name;
+		long long begin, end;	// ns since the profiler started
+	};
+
+	struct Ring
+	{
+		enum { CAPACITY = 1 << 16 };
+
+		Event events[CAPACITY];
+		std::atomic<unsigned int> written;
+		int thread;
+
+		Ring(int thread) : written(0), thread(thread) { }
+
+		// only ever called by the owning thread
+		void Push(const Event& e)
+		{
+			unsigned int n = written.load(std::memory_order_relaxed);
+			events[n & (CAPACITY - 1)] = e;
+			written.store(n + 1, std::memory_order_release);
+		}
+	};
+
+private:
+	std::chrono::steady_clock::time_point start;
+	std::mutex registration;	// taken when a thread records its first event and when writing
+	std::vector<Ring*> rings;
+
+public:
+	const char* tracePath;	// written on exit when set (--trace)
+
+	Profiler() : start(std::chrono::steady_clock::now()), tracePath(0) { }
+
+	long long Now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	Ring& ThreadRing()
+	{
+		static thread_local Ring* ring = 0;
+		if (!ring)
+		{
+			std::lock_guard<std::mutex> lock(registration);
+			ring = new Ring((int)rings.size() + 1);
+			rings.push_back(ring);
+		}
+		return *ring;
+	}
+
+	// Chrome trace event JSON, opens in chrome://tracing or ui.perfetto.dev.
+	// each ring is copied up to the head it had when the copy started, and
+	// whatever its thread may have overwritten during the copy is dropped
+	void Write(const char* path)
+	{
+		FILE* file = fopen(path, "w");
+		if (!file)
+		{
+			printf("profile: cannot write %s\n", path);
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(registration);
+		int count = 0;
+		fprintf(file, "{\"traceEvents\":[\n");
+		for (int r = 0; r < rings.size(); r++)
+		{
+			Ring* ring = rings[r];
+			unsigned int end = ring->written.load(std::memory_order_acquire);
+			unsigned int begin = end > Ring::CAPACITY ? end - Ring::CAPACITY : 0;
+			std::vector<Event> copy;
+			copy.reserve(end - begin);
+			for (unsigned int i = begin; i != end; i++) copy.push_back(ring->events[i & (Ring::CAPACITY - 1)]);
+
+			// the thread may be writing the slot of event 'now', which held event now - CAPACITY
+			unsigned int now = ring->written.load(std::memory_order_acquire);
+			unsigned int safe = now - begin >= Ring::CAPACITY ? now - begin - Ring::CAPACITY + 1 : 0;
+			for (unsigned int i = safe; i < copy.size(); i++)
+			{
+				const Event& e = copy[i];
+				fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+					count++ ? ",\n" : "", e.name, ring->thread, e.begin / 1000.0, (e.end - e.begin) / 1000.0);
+			}
+		}
+		fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+		fclose(file);
+		printf("profile: %d events written to %s\n", count, path);
+	}
+};
+
+Profiler profiler;
+
+class ProfileScope
+{
+	const char* name;
+	long long begin;
+
+public:
+	ProfileScope(const char* name) : name(name), begin(profiler.Now()) { }
+
+	~ProfileScope()
+	{
+		Profiler::Event e = { name, begin, profiler.Now() };
+		profiler.ThreadRing().Push(e);
+	}
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#if PROFILING
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#else
+#define PROFILE_SCOPE(name)
+#endif
+
 // vertex shader for textured quads
 const char *vertexSource0 = R"( 
 	#version 130 
@@ -73,10 +242,11 @@ const char *vertexSource0 = R"(
 	in vec2 vertexPosition; 
 	in vec2 vertexTexCoord; 
 	uniform mat4 MVP; 
+	uniform vec4 textureRect; 
 	out vec2 texCoord; 
 	
 	void main() { 
-		texCoord = vertexTexCoord; 
+		texCoord = textureRect.xy + vertexTexCoord * textureRect.zw; 
 		gl_Position = vec4(vertexPosition.x, vertexPosition.y, 0, 1) * MVP; 
 	} 
 )";
@@ -95,8 +265,9 @@ const char *fragmentSource0 = R"(
 	} 
 )";
 
-// vertex shader for textured quads
+// vertex shader for colored quads
 const char *vertexSource1 = R"( 
+	#version 130 
 	precision highp float; 
 	in vec2 vertexPosition; 
 	in vec3 vertexColor; 
@@ -120,6 +291,27 @@ const char *fragmentSource1 = R"(
 	} 
 )";
 
+// vertex shader for instanced textured quads, each instance carries its world
+// transform and the texture rectangle it samples; MVP holds the view
+const char *vertexSource3 = R"( 
+	#version 130 
+    	precision highp float; 
+	
+	in vec2 vertexPosition; 
+	in vec2 vertexTexCoord; 
+	in vec4 instanceAxes;		// row0 in xy, row1 in zw 
+	in vec2 instanceOrigin; 
+	in vec4 instanceRect; 
+	uniform mat4 MVP; 
+	out vec2 texCoord; 
+	
+	void main() { 
+		texCoord = instanceRect.xy + vertexTexCoord * instanceRect.zw; 
+		vec2 p = vertexPosition.x * instanceAxes.xy + vertexPosition.y * instanceAxes.zw + instanceOrigin; 
+		gl_Position = vec4(p, 0, 1) * MVP; 
+	} 
+)";
+
 // row-major matrix 4x4
 struct mat4
 {
@@ -211,741 +403,3884 @@ struct vec2
 	float length() { return sqrt(x * x + y * y); }
 };
 
+// 2D affine transform in the same row-vector convention as mat4: a point maps
+// to x * row0 + y * row1 + origin. It is a mat4 with only rows 0, 1 and 3 and
+// their first two columns, the rest being identity.
+struct affine2
+{
+	float row0[2], row1[2], origin[2];
 
+	static affine2 Scaling(float x, float y)
+	{
+		affine2 t = { { x, 0 }, { 0, y }, { 0, 0 } };
+		return t;
+	}
 
+	// scale, then rotate by degrees, then translate
+	static affine2 Sprite(vec2 scale, float degrees, vec2 position)
+	{
+		float radians = degrees / 180 * (float)M_PI;
+		float s = sinf(radians), c = cosf(radians);
+		affine2 t;
+		t.row0[0] = scale.x * c;	t.row0[1] = scale.x * s;
+		t.row1[0] = -scale.y * s;	t.row1[1] = scale.y * c;
+		t.origin[0] = position.x;	t.origin[1] = position.y;
+		return t;
+	}
 
-// shader program IDs
-unsigned int shaderProgram0;
-unsigned int shaderProgram1; // will be used for non-textured quads
-unsigned int shaderProgram2; // will be used for explosions
-
-
-enum OBJECT_TYPE { FIREBALL, LANDER, PLATFORM, QUAD, LIFE, 
-	DIAMOND, DIAMONDCOUNT, AFTERBURNER, POKEBALL, SKUNTANK,
-	FLAMETHROWER, BG};
+	// this transform followed by right
+	affine2 operator*(const affine2& right) const
+	{
+		affine2 t;
+		for (int k = 0; k < 2; k++)
+		{
+			t.row0[k] = row0[0] * right.row0[k] + row0[1] * right.row1[k];
+			t.row1[k] = row1[0] * right.row0[k] + row1[1] * right.row1[k];
+			t.origin[k] = origin[0] * right.row0[k] + origin[1] * right.row1[k] + right.origin[k];
+		}
+		return t;
+	}
 
-class Object {
-protected:
-	bool stillAlive;
-	vec2 position, scale;
-	float orientation;
+	mat4 ToMat4() const
+	{
+		return mat4(row0[0], row0[1], 0, 0,
+			row1[0], row1[1], 0, 0,
+			0, 0, 1, 0,
+			origin[0], origin[1], 0, 1);
+	}
+};
 
-	float angularVelocity;
+// world to clip space: squeezes x so the square playfield keeps its shape in
+// the window, recomputed only when the window is resized
+affine2 ViewTransform()
+{
+	return affine2::Scaling((float)windowHeight / windowWidth, 1);
+}
 
-	unsigned int vao;
-	unsigned int shader;
+affine2 view = ViewTransform();
 
-public:
-	Object(unsigned int sp) : scale(1.0, 1.0), orientation(0.0), stillAlive(true), angularVelocity(0.0), shader(sp) { }
 
-	vec2 velocity;
-	void Destroy() { stillAlive = false; }
-	bool StillAlive() { return stillAlive; }
-	vec2 Velocity() { return velocity; }
-	vec2 Scale() { return scale; }
-	float AngularVelocity() { return angularVelocity; };
 
-	void SetTransform()
-	{
-		mat4 scale(scale.x, 0, 0, 0,
-			0, scale.y, 0, 0,
-			0, 0, 1, 0,
-			0, 0, 0, 1);
 
-		float alpha = orientation / 180 * M_PI;
-		mat4 rotate(cos(alpha), sin(alpha), 0, 0,
-			-sin(alpha), cos(alpha), 0, 0,
-			0, 0, 1, 0,
-			0, 0, 0, 1);
+// shadows the GL state the game changes and drops calls that would set what
+// is already set; issued and skipped calls are counted per frame
+class GLState
+{
+	enum { UNKNOWN = 0xffffffff, TEXTURE_UNITS = 8 };
 
-		mat4 translate(1, 0, 0, 0,
-			0, 1, 0, 0,
-			0, 0, 1, 0,
-			position.x, position.y, 0, 1);
+	unsigned int program, vertexArray, activeUnit;
+	unsigned int textures[TEXTURE_UNITS];
+	unsigned int blend, blendSrc, blendDst;
 
+	bool Changed(unsigned int& current, unsigned int value)
+	{
+		if (current == value) { skipped++; return false; }
+		current = value;
+		issued++;
+		return true;
+	}
 
-		mat4 view((float)windowHeight / windowWidth, 0, 0, 0,
-			0, 1, 0, 0,
-			0, 0, 1, 0,
-			0, 0, 0, 1);
+public:
+	int issued, skipped;			// in the current frame
+	int lastIssued, lastSkipped;	// in the previous frame
+	long long totalIssued, totalSkipped;
+	int frames;
 
+	GLState() : issued(0), skipped(0), lastIssued(0), lastSkipped(0), totalIssued(0), totalSkipped(0), frames(0)
+	{
+		Invalidate();
+	}
 
-		mat4 MVPTransform = scale * rotate * translate * view;
-		int location = glGetUniformLocation(shader, "MVP");
-		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVPTransform);
-		else printf("uniform MVPTransform cannot be set\n");
+	// forget everything, for after code that talks to GL directly
+	void Invalidate()
+	{
+		program = vertexArray = activeUnit = UNKNOWN;
+		for (int i = 0; i < TEXTURE_UNITS; i++) textures[i] = UNKNOWN;
+		blend = blendSrc = blendDst = UNKNOWN;
 	}
 
-	virtual void Draw()
+	void UseProgram(unsigned int id)
 	{
-		glUseProgram(shader);
-		SetTransform();
-		DrawModel();
+		if (Changed(program, id)) glUseProgram(id);
 	}
 
-	virtual void DrawModel() = 0;
+	void BindVertexArray(unsigned int id)
+	{
+		if (Changed(vertexArray, id)) glBindVertexArray(id);
+	}
 
-	virtual void Move(float dt)
+	void BindTexture(unsigned int unit, unsigned int id)
 	{
-		position = position + velocity * dt;
+		if (textures[unit] == id) { skipped++; return; }
+		if (Changed(activeUnit, unit)) glActiveTexture(GL_TEXTURE0 + unit);
+		textures[unit] = id;
+		issued++;
+		glBindTexture(GL_TEXTURE_2D, id);
+	}
 
-		orientation = orientation + angularVelocity * dt;
+	void Blend(bool enabled)
+	{
+		if (!Changed(blend, enabled)) return;
+		if (enabled) glEnable(GL_BLEND);
+		else glDisable(GL_BLEND);
 	}
 
-	virtual void Control()
+	void BlendFunc(unsigned int src, unsigned int dst)
 	{
+		if (blendSrc == src && blendDst == dst) { skipped++; return; }
+		blendSrc = src;
+		blendDst = dst;
+		issued++;
+		glBlendFunc(src, dst);
+	}
 
+	// deleting a bound object reverts the binding to zero
+	void VertexArrayDeleted(unsigned int id)
+	{
+		if (vertexArray == id) vertexArray = 0;
 	}
 
-	virtual void Interact(Object*)
+	void TextureDeleted(unsigned int id)
 	{
+		for (int i = 0; i < TEXTURE_UNITS; i++)
+			if (textures[i] == id) textures[i] = 0;
+	}
 
+	void EndFrame()
+	{
+		lastIssued = issued;
+		lastSkipped = skipped;
+		totalIssued += issued;
+		totalSkipped += skipped;
+		frames++;
+		issued = skipped = 0;
 	}
+};
 
-	virtual OBJECT_TYPE GetType() = 0;
+GLState glState;
 
-	virtual bool TooClose(Object* o)
+// a linked shader program, its active uniforms and attributes are looked up
+// once at link time so nothing is searched by name while drawing
+class ShaderProgram
+{
+	unsigned int id;
+	std::vector<std::string> uniformNames;
+	std::vector<int> uniformLocations;
+
+	unsigned int Compile(unsigned int type, const char* source, const char* name)
 	{
-		if ((position - o->position).length() < 0.15) return true;
-		return false;
+		unsigned int shader = glCreateShader(type);
+		if (!shader) { printf("Error in %s creation\n", name); exit(1); }
+		glShaderSource(shader, 1, &source, NULL);
+		glCompileShader(shader);
+		checkShader(shader, name);
+		return shader;
 	}
 
-	vec2 GetPosition()
+	// strips the [0] suffix GL reports for arrays
+	static std::string BaseName(const char* name)
 	{
-		return position;
+		std::string base(name);
+		size_t bracket = base.find('[');
+		if (bracket != std::string::npos) base.resize(bracket);
+		return base;
 	}
-};
 
+	void Reflect()
+	{
+		char name[256];
+		int count, size, length;
+		unsigned int type;
+
+		glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &count);
+		for (int i = 0; i < count; i++)
+		{
+			glGetActiveUniform(id, i, sizeof(name), &length, &size, &type, name);
+			uniformNames.push_back(BaseName(name));
+			uniformLocations.push_back(glGetUniformLocation(id, name));
+		}
+	}
 
-class Quad : public Object {
 public:
-	Quad() : Object(shaderProgram1) {
-		// NOTE THAT shaderProgram1 IS NOT A VALID SHADER ID NOW, IT HAS TO BE INITIALIZED SIMILARLY AS shaderProgram0 IN onInitialization!
+	// locations of the uniforms the game sets, -1 if the program lacks them
+	int mvpLocation, samplerLocation, textureRectLocation;
 
-		glGenVertexArrays(1, &vao);
-		glBindVertexArray(vao);
+	ShaderProgram() : id(0), mvpLocation(-1), samplerLocation(-1), textureRectLocation(-1) { }
 
-		unsigned int vbo[2];
-		glGenBuffers(2, &vbo[0]);
+	// attributes[i] is bound to attribute array i
+	void Create(const char* name, const char* vertexSource, const char* fragmentSource,
+		const char* const* attributes, int attributeCount)
+	{
+		PROFILE_SCOPE("ShaderProgram::Create");
+		std::string label(name);
+		unsigned int vertexShader = Compile(GL_VERTEX_SHADER, vertexSource, (label + " vertex shader").c_str());
+		unsigned int fragmentShader = Compile(GL_FRAGMENT_SHADER, fragmentSource, (label + " fragment shader").c_str());
+
+		id = glCreateProgram();
+		if (!id) { printf("Error in %s program creation\n", name); exit(1); }
+		glAttachShader(id, vertexShader);
+		glAttachShader(id, fragmentShader);
+		for (int i = 0; i < attributeCount; i++) glBindAttribLocation(id, i, attributes[i]);
+		glBindFragDataLocation(id, 0, "fragmentColor");
+		glLinkProgram(id);
+		checkLinking(id);
+
+		// the program keeps them alive for as long as it needs them
+		glDeleteShader(vertexShader);
+		glDeleteShader(fragmentShader);
+
+		Reflect();
+		mvpLocation = Uniform("MVP");
+		samplerLocation = Uniform("samplerUnit");
+		textureRectLocation = Uniform("textureRect");
+	}
 
-		// vertex coordinates: vbo[0] -> Attrib Array 0 -> vertexPosition of the vertex shader
-		glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-		static float vertexCoords[] = { -0.5, -0.5, 0.5, -0.5, 0.5, 0.5, -0.5, 0.5 };
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+	void Destroy()
+	{
+		if (id) glDeleteProgram(id);
+		id = 0;
+	}
 
-		// vertex colors: vbo[1] -> Attrib Array 1 -> vertexColor of the vertex shader
-		glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
-		static float vertexColors[] = { 1, 0, 0,    0, 1, 0,    0, 0, 1,    1, 1, 1 };
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vertexColors), vertexColors, GL_STATIC_DRAW);
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+	unsigned int Id() { return id; }
+
+	int Uniform(const char* name)
+	{
+		for (int i = 0; i < uniformNames.size(); i++)
+			if (uniformNames[i] == name) return uniformLocations[i];
+		return -1;
 	}
 
-	virtual void DrawModel() {
-		glBindVertexArray(vao);
-		glDrawArrays(GL_QUADS, 0, 4);
+	void Use() { glState.UseProgram(id); }
+
+	// setters quietly ignore uniforms the program does not have
+	void SetUniform(int location, int value)
+	{
+		if (location >= 0) glUniform1i(location, value);
 	}
 
-	OBJECT_TYPE GetType() { return QUAD; }
+	void SetUniform(int location, const float* vec4)
+	{
+		if (location >= 0) glUniform4fv(location, 1, vec4);
+	}
+
+	// row-major, as mat4 stores it
+	void SetUniform(int location, mat4& matrix)
+	{
+		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, matrix);
+	}
 };
 
+ShaderProgram texturedShader;	// textured quads
+ShaderProgram coloredShader;	// non-textured quads
+ShaderProgram instancedShader;	// instanced textured quads
 
-extern "C" unsigned char* stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
+// instanced drawing needs glVertexAttribDivisor (GL 3.3)
+bool instancingSupported = false;
 
-class Texture
+struct SpriteInstance
 {
-	unsigned int textureId;
+	affine2 transform;
+	float rect[4];	// texture offset and size
+};
+
+// a run of sprite instances drawn from one texture page
+struct SpriteRange
+{
+	unsigned int page;
+	int first, count;
+};
+
+// vertex of the colored shader, positions in clip space
+struct ColoredVertex
+{
+	float x, y;
+	float r, g, b;
+};
 
+// everything the game asks of the graphics API; objects, textures and the
+// sprite batch only go through this, so the simulation can run without a window
+class RenderBackend
+{
 public:
-	Texture(const std::string& inputFileName)
-	{
-		unsigned char* data;
-		int width; int height; int nComponents = 4;
+	int drawCalls;	// since the caller last reset it
 
-		data = stbi_load(inputFileName.c_str(), &width, &height, &nComponents, 0);
+	RenderBackend() : drawCalls(0) { }
+	virtual ~RenderBackend() { }
 
-		if (data == NULL)
-		{
-			return;
-		}
+	// vertex coordinates go to attrib array 0, attribSize floats per vertex to array 1
+	virtual unsigned int CreateQuadMesh(const float* coords, const float* attribs, int attribSize, unsigned int vbo[2]) = 0;
+	virtual void DeleteQuadMesh(unsigned int vao, unsigned int vbo[2]) = 0;
 
-		glGenTextures(1, &textureId);
-		glBindTexture(GL_TEXTURE_2D, textureId);
+	virtual int MaxTextureSize() = 0;
+	virtual unsigned int CreateTexture(int width, int height, const unsigned char* rgba) = 0;
+	virtual void UpdateTexture(unsigned int texture, int x, int y, int width, int height, const unsigned char* rgba) = 0;
+	virtual void DeleteTexture(unsigned int texture) = 0;
 
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+	// asynchronous upload: BeginUpload hands out bytes of memory any thread may
+	// fill, FinishUpload turns it into a new texture without waiting for the copy
+	virtual unsigned char* BeginUpload(int bytes, unsigned int& buffer) = 0;
+	virtual unsigned int FinishUpload(unsigned int buffer, unsigned char* memory, int width, int height) = 0;
 
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	virtual bool Instancing() = 0;
 
-		delete data;
-	}
+	// texture 0 draws the mesh with its vertex colors
+	virtual void DrawQuad(ShaderProgram* shader, mat4& MVP, unsigned int vao, unsigned int texture, const float* rect) = 0;
+	virtual void DrawSprites(const SpriteInstance* instances, int count, const SpriteRange* ranges, int rangeCount) = 0;
 
-	void Bind(unsigned int shader)
-	{
-		int samplerUnit = 0;
-		int location = glGetUniformLocation(shader, "samplerUnit");
-		glUniform1i(location, samplerUnit);
-		glActiveTexture(GL_TEXTURE0 + samplerUnit);
-		glBindTexture(GL_TEXTURE_2D, textureId);
-	}
+	// untextured triangles with the colored quad shader, in one draw call
+	virtual void DrawColored(const ColoredVertex* vertices, int count) = 0;
 };
 
-
-class TexturedQuad : public Object
+class GLBackend : public RenderBackend
 {
-	Texture *texture;
+	unsigned int spriteVao, instanceVbo;
+	unsigned int coloredVao, coloredVbo;
+
+	// pixel unpack buffers for BeginUpload, kept and reused
+	struct UploadBuffer
+	{
+		unsigned int id;
+		int capacity;
+		bool busy;
+	};
+	std::vector<UploadBuffer> uploadBuffers;
+
+	void SetInstanceOffset(size_t first)
+	{
+		char* base = (char*)(first * sizeof(SpriteInstance));
+		// row0 and row1 are adjacent, so the two axes read as one vec4
+		glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(SpriteInstance), base + offsetof(SpriteInstance, transform.row0));
+		glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(SpriteInstance), base + offsetof(SpriteInstance, transform.origin));
+		glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(SpriteInstance), base + offsetof(SpriteInstance, rect));
+	}
 
 public:
+	GLBackend() : spriteVao(0), instanceVbo(0), coloredVao(0), coloredVbo(0) { }
 
-	TexturedQuad(Texture* t, unsigned int sp = shaderProgram0) : Object(sp), texture(t)
+	// sets up the instanced sprite path once the shaders are linked
+	void Initialize();
+	// deletes what Initialize and the draw calls created, while the context is still current
+	void Shutdown();
+
+	unsigned int CreateQuadMesh(const float* coords, const float* attribs, int attribSize, unsigned int vbo[2])
 	{
+		unsigned int vao;
 		glGenVertexArrays(1, &vao);
-		glBindVertexArray(vao);
-
-		unsigned int vbo[2];
+		glState.BindVertexArray(vao);
 		glGenBuffers(2, &vbo[0]);
 
 		glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-		static float vertexCoords[] = { -0.5, 0.5, 0.5, 0.5, 0.5, -0.5, -0.5, -0.5 };
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);
+		glBufferData(GL_ARRAY_BUFFER, 8 * sizeof(float), coords, GL_STATIC_DRAW);
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
 
-
 		glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
-		static float vertexTexCoord[] = { 0, 0,  1, 0,  1, 1,  0, 1 };
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vertexTexCoord), vertexTexCoord, GL_STATIC_DRAW);
+		glBufferData(GL_ARRAY_BUFFER, 4 * attribSize * sizeof(float), attribs, GL_STATIC_DRAW);
 		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+		glVertexAttribPointer(1, attribSize, GL_FLOAT, GL_FALSE, 0, NULL);
+		return vao;
 	}
 
-	virtual void DrawModel()
+	void DeleteQuadMesh(unsigned int vao, unsigned int vbo[2])
 	{
-		texture->Bind(shader);
-
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		glBindVertexArray(vao);
-		glDrawArrays(GL_QUADS, 0, 4);
-		glDisable(GL_BLEND);
+		glDeleteBuffers(2, &vbo[0]);
+		glDeleteVertexArrays(1, &vao);
+		glState.VertexArrayDeleted(vao);
 	}
-};
 
-boolean landed = false;
-int lives = 3;
-boolean keyDown = false;
+	int MaxTextureSize()
+	{
+		int size;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &size);
+		return size;
+	}
 
-vec2 posn;
+	unsigned int CreateTexture(int width, int height, const unsigned char* rgba)
+	{
+		unsigned int texture;
+		glGenTextures(1, &texture);
+		glState.BindTexture(0, texture);
 
-class Afterburner : public TexturedQuad
-{
-	Texture *texture = new Texture("afterburner.png");
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
 
-public:
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		return texture;
+	}
 
-	Afterburner(Texture* t) : TexturedQuad(t)
+	void UpdateTexture(unsigned int texture, int x, int y, int width, int height, const unsigned char* rgba)
 	{
-		scale = vec2(0.3, 0.3);
-		position = vec2(posn.x, posn.y - 0.1);
+		glState.BindTexture(0, texture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
 	}
 
-	OBJECT_TYPE GetType() { return AFTERBURNER; }
-
-	void Control()
+	void DeleteTexture(unsigned int texture)
 	{
-		position = vec2(posn.x -0.04, posn.y - 0.25);
+		glDeleteTextures(1, &texture);
+		glState.TextureDeleted(texture);
 	}
 
-	virtual void DrawModel()
+	// maps an idle pixel unpack buffer until FinishUpload, the smallest one that
+	// is large enough, else the largest idle one grown, else a new one
+	unsigned char* BeginUpload(int bytes, unsigned int& buffer)
 	{
-		if (keyDown) {
-			texture->Bind(shader);
+		int pick = -1;
+		for (int i = 0; i < uploadBuffers.size(); i++)
+		{
+			if (uploadBuffers[i].busy) continue;
+			if (pick < 0) { pick = i; continue; }
+			bool fits = uploadBuffers[i].capacity >= bytes, pickFits = uploadBuffers[pick].capacity >= bytes;
+			if (fits ? !pickFits || uploadBuffers[i].capacity < uploadBuffers[pick].capacity
+				: !pickFits && uploadBuffers[i].capacity > uploadBuffers[pick].capacity) pick = i;
+		}
+		if (pick < 0)
+		{
+			UploadBuffer created = { 0, 0, false };
+			glGenBuffers(1, &created.id);
+			uploadBuffers.push_back(created);
+			pick = (int)uploadBuffers.size() - 1;
+		}
 
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-			glBindVertexArray(vao);
-			glDrawArrays(GL_QUADS, 0, 4);
-			glDisable(GL_BLEND);
+		UploadBuffer& upload = uploadBuffers[pick];
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload.id);
+		if (upload.capacity < bytes)
+		{
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+			upload.capacity = bytes;
 		}
+		// invalidating lets the driver hand out fresh storage if the last upload is still being read
+		void* memory = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		if (memory) upload.busy = true;
+		buffer = upload.id;
+		return (unsigned char*)memory;
 	}
-};
 
-class Lander : public TexturedQuad
-{
+	// the copy out of the buffer is queued, the buffer is free for the next BeginUpload
+	unsigned int FinishUpload(unsigned int buffer, unsigned char*, int width, int height)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+		unsigned int texture = 0;
+		if (glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE)
+			texture = CreateTexture(width, height, NULL);	// NULL is offset 0 into the buffer
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		for (int i = 0; i < uploadBuffers.size(); i++)
+			if (uploadBuffers[i].id == buffer) uploadBuffers[i].busy = false;
+		return texture;
+	}
 
-public:
+	bool Instancing() { return instancingSupported; }
 
-	Lander(Texture* t) : TexturedQuad(t)
+	void DrawQuad(ShaderProgram* shader, mat4& MVP, unsigned int vao, unsigned int texture, const float* rect)
 	{
-		scale = vec2(0.3, 0.3);
-		position = vec2(0.0, 0.7);
+		shader->Use();
+		shader->SetUniform(shader->mvpLocation, MVP);
+		if (texture)
+		{
+			shader->SetUniform(shader->samplerLocation, 0);
+			shader->SetUniform(shader->textureRectLocation, rect);
+			glState.BindTexture(0, texture);
+			glState.Blend(true);
+			glState.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		}
+		else glState.Blend(false);
+
+		glState.BindVertexArray(vao);
+		glDrawArrays(GL_QUADS, 0, 4);
+		drawCalls++;
 	}
 
-	void Control()
+	void DrawSprites(const SpriteInstance* instances, int count, const SpriteRange* ranges, int rangeCount)
 	{
-		if (lives == 0) Destroy();
-		if (!landed) {
-
-			angularVelocity = 0.0;
-			
-			if (keyPressed['a']) {
-				velocity = velocity + vec2(-0.01, 0);
-				angularVelocity += 20.0;
-			}
-			if (keyPressed['d']) {
-				velocity = velocity + vec2(0.01, 0);
-				angularVelocity -= 20.0;
-			}
-			if (keyPressed['w']) {
-				velocity = velocity + vec2(0, 0.01);
-			}
-			if (keyPressed['s']) {
-				velocity = velocity + vec2(0, -0.01);
-			}
-			velocity = velocity + vec2(0, -0.003);
-		}
-		else {
-			velocity = vec2(0.0, 0.0);
-			angularVelocity = 0.0;
+		instancedShader.Use();
+		instancedShader.SetUniform(instancedShader.samplerLocation, 0);
+		mat4 viewMatrix = view.ToMat4();
+		instancedShader.SetUniform(instancedShader.mvpLocation, viewMatrix);
+		glState.BindVertexArray(spriteVao);
+		glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+		glBufferData(GL_ARRAY_BUFFER, count * sizeof(SpriteInstance), instances, GL_STREAM_DRAW);
+
+		glState.Blend(true);
+		glState.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		for (int i = 0; i < rangeCount; i++)
+		{
+			SetInstanceOffset(ranges[i].first);
+			glState.BindTexture(0, ranges[i].page);
+			glDrawArraysInstanced(GL_QUADS, 0, 4, ranges[i].count);
 		}
-		posn = GetPosition();
+		drawCalls += rangeCount;
 	}
 
-	void Interact(Object* o)
+	void DrawColored(const ColoredVertex* vertices, int count)
 	{
-		if (o->GetType() == FIREBALL)
+		if (!coloredVao)
 		{
-			if (TooClose(o))
-			{
-				o->Destroy();
-				lives -= 1;
-			}
+			glGenVertexArrays(1, &coloredVao);
+			glState.BindVertexArray(coloredVao);
+			glGenBuffers(1, &coloredVbo);
+			glBindBuffer(GL_ARRAY_BUFFER, coloredVbo);
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(ColoredVertex), (void*)offsetof(ColoredVertex, x));
+			glEnableVertexAttribArray(1);
+			glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(ColoredVertex), (void*)offsetof(ColoredVertex, r));
 		}
-	}
 
-	OBJECT_TYPE GetType() { return LANDER; }
+		coloredShader.Use();
+		mat4 identity(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1);
+		coloredShader.SetUniform(coloredShader.mvpLocation, identity);
+		glState.Blend(false);
+		glState.BindVertexArray(coloredVao);
+		glBindBuffer(GL_ARRAY_BUFFER, coloredVbo);
+		glBufferData(GL_ARRAY_BUFFER, count * sizeof(ColoredVertex), vertices, GL_STREAM_DRAW);
+		glDrawArrays(GL_TRIANGLES, 0, count);
+		drawCalls++;
+	}
 };
 
-class Life : public TexturedQuad
+// used instead of GL when running headless: hands out ids and draws nothing
+class NullBackend : public RenderBackend
 {
+	unsigned int nextId;
+
 public:
+	NullBackend() : nextId(1) { }
 
-	Life(Texture* t, int place) : TexturedQuad(t)
+	unsigned int CreateQuadMesh(const float*, const float*, int, unsigned int vbo[2])
 	{
-		scale = vec2(0.1, 0.1);
-		position = vec2(-1 + (place *.1), .75);
+		vbo[0] = vbo[1] = 0;
+		return nextId++;
 	}
 
-	OBJECT_TYPE GetType() { return LIFE; }
-};
+	void DeleteQuadMesh(unsigned int, unsigned int[2]) { }
+	int MaxTextureSize() { return 16384; }
+	unsigned int CreateTexture(int, int, const unsigned char*) { return nextId++; }
+	void UpdateTexture(unsigned int, int, int, int, int, const unsigned char*) { }
+	void DeleteTexture(unsigned int) { }
 
-class DiamondCount : public TexturedQuad
-{
-public:
+	unsigned char* BeginUpload(int bytes, unsigned int& buffer)
+	{
+		buffer = nextId++;
+		return (unsigned char*)malloc(bytes);
+	}
 
-	DiamondCount(Texture* t, int place) : TexturedQuad(t)
+	unsigned int FinishUpload(unsigned int, unsigned char* memory, int, int)
 	{
-		scale = vec2(0.1, 0.1);
-		position = vec2(1 - (place *.1), .75);
+		free(memory);
+		return nextId++;
 	}
 
-	OBJECT_TYPE GetType() { return DIAMONDCOUNT; }
+	bool Instancing() { return true; }
+	void DrawQuad(ShaderProgram*, mat4&, unsigned int, unsigned int, const float*) { drawCalls++; }
+	void DrawSprites(const SpriteInstance*, int, const SpriteRange*, int rangeCount) { drawCalls += rangeCount; }
+	void DrawColored(const ColoredVertex*, int) { drawCalls++; }
 };
 
-boolean newDiamond = false;
-int diamonds = 0;
+GLBackend glBackend;
+NullBackend nullBackend;
+RenderBackend* renderer = &glBackend;
 
-class Diamond : public TexturedQuad
-{
-public:
 
-	Diamond(Texture* t) : TexturedQuad(t)
-	{
-		scale = vec2(0.05, 0.05);
-		position = vec2::random();
-		velocity = vec2(0.0, -0.1);
-	}
+// distance below which two objects interact
+const float interactionRadius = 0.15f;
 
-		virtual void Move(float dt)
-	{
-		Object::Move(dt);
-		if (position.x < -2) position.x = 2;
-		if (position.x >  2) position.x = -2;
-		if (position.y < -2) position.y = 2;
-		if (position.y >  2) position.y = -2;
-	}
+enum OBJECT_TYPE { FIREBALL, LANDER, PLATFORM, QUAD, LIFE, 
+	DIAMOND, DIAMONDCOUNT, AFTERBURNER, POKEBALL, SKUNTANK,
+	FLAMETHROWER, BG, FLIPPER, PLATFORMEND, BOOM, OBJECT_TYPE_COUNT };
 
-	OBJECT_TYPE GetType() { return DIAMOND; }
+// what an entity kind does at the edge of the playfield after moving
+enum BOUNDS { BOUNDS_NONE, BOUNDS_WRAP, BOUNDS_CULL };
 
-	void Interact(Object* o)
-	{
-		if (o->GetType() == LANDER)
-		{
-			if (TooClose(o))
-			{
-				Destroy();
-				newDiamond = true;
-				diamonds += 1;
-			}
+// how an entity kind moves: static ones sleep until something gives them a
+// velocity, kinematic ones are steered by their Control every tick and
+// dynamic ones just keep integrating their velocity
+enum MOTION { MOTION_STATIC, MOTION_KINEMATIC, MOTION_DYNAMIC };
+
+struct KindInfo
+{
+	BOUNDS bounds;
+	float limit;
+	MOTION motion;
+};
+
+// per-kind behaviour table, indexed by OBJECT_TYPE
+const KindInfo kindInfo[] = {
+	{ BOUNDS_WRAP, 2, MOTION_DYNAMIC },	// FIREBALL
+	{ BOUNDS_NONE, 0, MOTION_KINEMATIC },	// LANDER
+	{ BOUNDS_NONE, 0, MOTION_STATIC },	// PLATFORM
+	{ BOUNDS_NONE, 0, MOTION_STATIC },	// QUAD
+	{ BOUNDS_NONE, 0, MOTION_STATIC },	// LIFE
+	{ BOUNDS_WRAP, 2, MOTION_DYNAMIC },	// DIAMOND
+	{ BOUNDS_NONE, 0, MOTION_STATIC },	// DIAMONDCOUNT
+	{ BOUNDS_NONE, 0, MOTION_KINEMATIC },	// AFTERBURNER
+	{ BOUNDS_CULL, 1, MOTION_DYNAMIC },	// POKEBALL
+	{ BOUNDS_NONE, 0, MOTION_STATIC },	// SKUNTANK
+	{ BOUNDS_CULL, 1, MOTION_DYNAMIC },	// FLAMETHROWER
+	{ BOUNDS_NONE, 0, MOTION_STATIC },	// BG
+	{ BOUNDS_NONE, 0, MOTION_STATIC },	// FLIPPER
+	{ BOUNDS_NONE, 0, MOTION_STATIC },	// PLATFORMEND
+	{ BOUNDS_NONE, 0, MOTION_KINEMATIC },	// BOOM
+};
+
+// the interleaved x, y arrays of one Move, treated as flat float arrays of
+// 2 * count values. Entities that do not wrap or cull have a limit of FLT_MAX.
+struct MoveBatch
+{
+	float* position;
+	const float* velocity;
+	const float* wrapLimit;
+	const float* cullLimit;
+	float* orientation;
+	const float* angularVelocity;
+	int count;
+};
+
+// integrates a batch, wraps positions past their wrap limit to the opposite
+// edge and appends the index of every entity past its cull limit
+typedef void (*MoveKernel)(const MoveBatch& b, float dt, std::vector<int>& culled);
+
+// one value of the scalar kernel, also used for the tails of the vector ones
+inline void MoveValue(const MoveBatch& b, int i, float dt, std::vector<int>& culled)
+{
+	float x = b.position[i] + b.velocity[i] * dt;
+	float limit = b.wrapLimit[i];
+	x = x < -limit ? limit : (x > limit ? -limit : x);
+	b.position[i] = x;
+	if (fabs(x) > b.cullLimit[i] && (culled.empty() || culled.back() != i / 2)) culled.push_back(i / 2);
+}
+
+void MoveScalar(const MoveBatch& b, float dt, std::vector<int>& culled)
+{
+	for (int i = 0; i < 2 * b.count; i++) MoveValue(b, i, dt, culled);
+	for (int i = 0; i < b.count; i++) b.orientation[i] += b.angularVelocity[i] * dt;
+}
+
+#if defined(SIMD_X86)
+void MoveSSE2(const MoveBatch& b, float dt, std::vector<int>& culled)
+{
+	const __m128 step = _mm_set1_ps(dt);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	int n = 2 * b.count, i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 x = _mm_add_ps(_mm_loadu_ps(b.position + i), _mm_mul_ps(_mm_loadu_ps(b.velocity + i), step));
+		__m128 limit = _mm_loadu_ps(b.wrapLimit + i);
+		__m128 negated = _mm_xor_ps(limit, sign);
+		__m128 below = _mm_cmplt_ps(x, negated), above = _mm_cmpgt_ps(x, limit);
+		x = _mm_or_ps(_mm_andnot_ps(_mm_or_ps(below, above), x),
+			_mm_or_ps(_mm_and_ps(below, limit), _mm_and_ps(above, negated)));
+		_mm_storeu_ps(b.position + i, x);
+
+		int outside = _mm_movemask_ps(_mm_cmpgt_ps(_mm_andnot_ps(sign, x), _mm_loadu_ps(b.cullLimit + i)));
+		if (outside)
+		{
+			if (outside & 3) culled.push_back(i / 2);
+			if (outside & 12) culled.push_back(i / 2 + 1);
+		}
+	}
+	for (; i < n; i++) MoveValue(b, i, dt, culled);
+
+	i = 0;
+	for (; i + 4 <= b.count; i += 4)
+		_mm_storeu_ps(b.orientation + i, _mm_add_ps(_mm_loadu_ps(b.orientation + i),
+			_mm_mul_ps(_mm_loadu_ps(b.angularVelocity + i), step)));
+	for (; i < b.count; i++) b.orientation[i] += b.angularVelocity[i] * dt;
+}
+
+TARGET_AVX2 void MoveAVX2(const MoveBatch& b, float dt, std::vector<int>& culled)
+{
+	const __m256 step = _mm256_set1_ps(dt);
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	int n = 2 * b.count, i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 x = _mm256_add_ps(_mm256_loadu_ps(b.position + i), _mm256_mul_ps(_mm256_loadu_ps(b.velocity + i), step));
+		__m256 limit = _mm256_loadu_ps(b.wrapLimit + i);
+		__m256 negated = _mm256_xor_ps(limit, sign);
+		__m256 below = _mm256_cmp_ps(x, negated, _CMP_LT_OQ), above = _mm256_cmp_ps(x, limit, _CMP_GT_OQ);
+		x = _mm256_blendv_ps(_mm256_blendv_ps(x, limit, below), negated, above);
+		_mm256_storeu_ps(b.position + i, x);
+
+		int outside = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_andnot_ps(sign, x),
+			_mm256_loadu_ps(b.cullLimit + i), _CMP_GT_OQ));
+		if (outside)
+		{
+			for (int e = 0; e < 4; e++)
+				if (outside >> (2 * e) & 3) culled.push_back(i / 2 + e);
+		}
+	}
+	for (; i < n; i++) MoveValue(b, i, dt, culled);
+
+	i = 0;
+	for (; i + 8 <= b.count; i += 8)
+		_mm256_storeu_ps(b.orientation + i, _mm256_add_ps(_mm256_loadu_ps(b.orientation + i),
+			_mm256_mul_ps(_mm256_loadu_ps(b.angularVelocity + i), step)));
+	for (; i < b.count; i++) b.orientation[i] += b.angularVelocity[i] * dt;
+	_mm256_zeroupper();
+}
+
+bool CpuSupports(bool avx2)
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int highest = info[0];
+	__cpuid(info, 1);
+	bool sse2 = (info[3] & (1 << 26)) != 0;
+	if (!avx2) return sse2;
+	// AVX state has to be enabled by the OS as well
+	bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+	if (highest < 7 || !osxsave || !avx || (_xgetbv(0) & 6) != 6) return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return avx2 ? __builtin_cpu_supports("avx2") != 0 : __builtin_cpu_supports("sse2") != 0;
+#endif
+}
+#endif
+
+// kernels from narrowest to widest; the widest one the CPU runs is used
+// unless --simd asks for a narrower one
+const char* simdNames[] = { "scalar", "sse2", "avx2" };
+
+int SimdLevel()
+{
+#if defined(SIMD_X86)
+	if (CpuSupports(true)) return 2;
+	if (CpuSupports(false)) return 1;
+#endif
+	return 0;
+}
+
+MoveKernel MoveKernelFor(int level)
+{
+#if defined(SIMD_X86)
+	if (level >= 2) return MoveAVX2;
+	if (level == 1) return MoveSSE2;
+#endif
+	return MoveScalar;
+}
+
+MoveKernel moveKernel = MoveKernelFor(SimdLevel());
+
+class Object;
+class SpriteBatch;
+
+// structure-of-arrays storage for the per-entity simulation state; entries are
+// kept dense, removing one moves the last entry into its place. Awake entries
+// come first: Move only touches [0, awake), sleeping static ones follow.
+class EntityStore
+{
+	void SwapEntries(int a, int b);
+
+public:
+	int awake;
+
+	std::vector<vec2> position, velocity, scale;
+	std::vector<float> orientation, angularVelocity;
+	std::vector<vec2> previousPosition;		// state before the last Move, for interpolation
+	std::vector<float> previousOrientation;
+	std::vector<unsigned char> kind, alive;
+	std::vector<Object*> owner;
+	std::vector<vec2> wrapLimit, cullLimit;	// from kindInfo, FLT_MAX where unused
+
+	std::vector<int> culled;
+	std::vector<affine2> transform;	// world transforms, cached by BuildTransforms
+	std::vector<unsigned char> dirty;	// transform needs rebuilding
+
+	// objects killed this tick, deleted by the scene at the end of the tick
+	std::vector<Object*> destroyed;
+
+	EntityStore() : awake(0) { }
+
+	int Count() { return (int)owner.size(); }
+
+	void Wake(int i)
+	{
+		if (i >= awake) SwapEntries(i, awake++);
+	}
+
+	// comes to rest where it is, without interpolating the last step
+	void Sleep(int i)
+	{
+		if (i >= awake) return;
+		previousPosition[i] = position[i];
+		previousOrientation[i] = orientation[i];
+		dirty[i] = 1;
+		SwapEntries(i, --awake);
+	}
+
+	// a sleeping entity jumps to a new position, an awake one moves there
+	// over the next frame
+	void SetPosition(int i, vec2 p)
+	{
+		position[i] = p;
+		if (i >= awake) previousPosition[i] = p;
+		dirty[i] = 1;
+	}
+
+	void SetVelocity(int i, vec2 v)
+	{
+		velocity[i] = v;
+		if (v.x != 0 || v.y != 0) Wake(i);
+	}
+
+	void SetAngularVelocity(int i, float w)
+	{
+		angularVelocity[i] = w;
+		if (w != 0) Wake(i);
+	}
+
+	void Kill(int i)
+	{
+		if (!alive[i]) return;
+		alive[i] = 0;
+		destroyed.push_back(owner[i]);
+	}
+
+	// snapshot the current state as the start of the next interpolation;
+	// whatever moved in the last tick has to be drawn once more at rest
+	void SavePrevious()
+	{
+		for (int i = 0; i < awake; i++)
+		{
+			if (Moved(i)) dirty[i] = 1;
+			previousPosition[i] = position[i];
+			previousOrientation[i] = orientation[i];
+		}
+	}
+
+	bool Moved(int i)
+	{
+		return position[i].x != previousPosition[i].x || position[i].y != previousPosition[i].y ||
+			orientation[i] != previousOrientation[i];
+	}
+
+	// whether the last Move changed anything that is drawn
+	bool AnyMoved()
+	{
+		for (int i = 0; i < awake; i++)
+			if (Moved(i)) return true;
+		return false;
+	}
+
+	// state blended between the last two ticks, a jump of more than one unit
+	// (wrapping around the playfield) is not blended
+	vec2 RenderPosition(int i, float alpha)
+	{
+		vec2 p = position[i], q = previousPosition[i];
+		if (fabs(p.x - q.x) > 1 || fabs(p.y - q.y) > 1) return p;
+		return q + (p - q) * alpha;
+	}
+
+	float RenderOrientation(int i, float alpha)
+	{
+		return previousOrientation[i] + (orientation[i] - previousOrientation[i]) * alpha;
+	}
+
+	// brings the world transform of every entity up to date for a frame drawn
+	// alpha of the way from the previous tick. Only entities that moved in the
+	// last tick, or were changed directly, are recomputed; sleeping ones
+	// never move.
+	int BuildTransforms(float alpha)
+	{
+		int n = Count(), built = 0;
+		for (int i = 0; i < n; i++)
+		{
+			if (!dirty[i] && (i >= awake || !Moved(i))) continue;
+			transform[i] = affine2::Sprite(scale[i], RenderOrientation(i, alpha), RenderPosition(i, alpha));
+			dirty[i] = 0;
+			built++;
+		}
+		return built;
+	}
+
+	int Add(Object* o, OBJECT_TYPE type)
+	{
+		position.push_back(vec2(0, 0));
+		velocity.push_back(vec2(0, 0));
+		scale.push_back(vec2(1, 1));
+		orientation.push_back(0);
+		angularVelocity.push_back(0);
+		previousPosition.push_back(vec2(0, 0));
+		previousOrientation.push_back(0);
+		kind.push_back(type);
+		alive.push_back(1);
+		owner.push_back(o);
+		const KindInfo& k = kindInfo[type];
+		float wrap = k.bounds == BOUNDS_WRAP ? k.limit : FLT_MAX;
+		float cull = k.bounds == BOUNDS_CULL ? k.limit : FLT_MAX;
+		wrapLimit.push_back(vec2(wrap, wrap));
+		cullLimit.push_back(vec2(cull, cull));
+		transform.push_back(affine2::Scaling(1, 1));
+		dirty.push_back(1);
+		int slot = Count() - 1;
+		if (k.motion != MOTION_STATIC)
+		{
+			SwapEntries(slot, awake);
+			slot = awake++;
+		}
+		return slot;
+	}
+
+	void Remove(int index);
+
+	void Move(float dt)
+	{
+		SavePrevious();
+
+		if (awake == 0) return;
+		MoveBatch b = { &position[0].x, &velocity[0].x, &wrapLimit[0].x, &cullLimit[0].x,
+			orientation.data(), angularVelocity.data(), awake };
+		culled.clear();
+		moveKernel(b, dt, culled);
+		for (int i = 0; i < culled.size(); i++) Kill(culled[i]);
+
+		// static entities that were pushed go back to sleep once they stop
+		for (int i = awake - 1; i >= 0; i--)
+		{
+			if (kindInfo[kind[i]].motion == MOTION_STATIC && velocity[i].x == 0 && velocity[i].y == 0 &&
+				angularVelocity[i] == 0) Sleep(i);
+		}
+	}
+};
+
+static_assert(sizeof(vec2) == 2 * sizeof(float), "vec2 arrays are moved as flat float arrays");
+
+EntityStore entities;
+
+// fraction of a tick the rendered frame lies past the last simulated state
+float renderAlpha = 1;
+
+// unit quads: vertex coordinates go to attrib array 0, colors or texture
+// coordinates to attrib array 1
+static float quadCoords[] = { -0.5, -0.5, 0.5, -0.5, 0.5, 0.5, -0.5, 0.5 };
+static float quadColors[] = { 1, 0, 0,    0, 1, 0,    0, 0, 1,    1, 1, 1 };
+static float texturedQuadCoords[] = { -0.5, 0.5, 0.5, 0.5, 0.5, -0.5, -0.5, -0.5 };
+static float texturedQuadTexCoords[] = { 0, 0,  1, 0,  1, 1,  0, 1 };
+
+// reference counted quad geometry shared by every object of one style, the
+// buffers are created by the first user and deleted when the last one goes away
+class QuadMesh
+{
+	const float* coords;
+	const float* attribs;
+	int attribSize;
+	int references;
+
+public:
+	unsigned int vao;
+	unsigned int vbo[2];
+
+	QuadMesh(const float* coords, const float* attribs, int attribSize)
+		: coords(coords), attribs(attribs), attribSize(attribSize), references(0), vao(0) { }
+
+	unsigned int Acquire()
+	{
+		if (references++ > 0) return vao;
+
+		vao = renderer->CreateQuadMesh(coords, attribs, attribSize, vbo);
+		return vao;
+	}
+
+	void Release()
+	{
+		if (--references > 0) return;
+
+		renderer->DeleteQuadMesh(vao, vbo);
+		vao = 0;
+	}
+};
+
+QuadMesh coloredQuadMesh(quadCoords, quadColors, 3);
+QuadMesh texturedQuadMesh(texturedQuadCoords, texturedQuadTexCoords, 2);
+
+void GLBackend::Initialize()
+{
+	if (!instancingSupported) return;
+
+	// sprites have their own vertex array but read the shared quad buffers
+	texturedQuadMesh.Acquire();
+	glGenVertexArrays(1, &spriteVao);
+	glState.BindVertexArray(spriteVao);
+
+	glBindBuffer(GL_ARRAY_BUFFER, texturedQuadMesh.vbo[0]);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+
+	glBindBuffer(GL_ARRAY_BUFFER, texturedQuadMesh.vbo[1]);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+
+	glGenBuffers(1, &instanceVbo);
+	glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+	for (int i = 2; i <= 4; i++)
+	{
+		glEnableVertexAttribArray(i);
+		glVertexAttribDivisor(i, 1);
+	}
+}
+
+void GLBackend::Shutdown()
+{
+	if (spriteVao)
+	{
+		glDeleteVertexArrays(1, &spriteVao);
+		glDeleteBuffers(1, &instanceVbo);
+		texturedQuadMesh.Release();
+		spriteVao = instanceVbo = 0;
+	}
+	if (coloredVao)
+	{
+		glDeleteVertexArrays(1, &coloredVao);
+		glDeleteBuffers(1, &coloredVbo);
+		coloredVao = coloredVbo = 0;
+	}
+	// deleting a buffer that is still mapped unmaps it
+	for (int i = 0; i < uploadBuffers.size(); i++) glDeleteBuffers(1, &uploadBuffers[i].id);
+	uploadBuffers.clear();
+}
+
+// weak reference to an object: stays valid while the object lives, whatever
+// happens to its position in the object list or the entity store, and
+// resolves to null once the object is deleted
+struct Handle
+{
+	int index;
+	unsigned generation;
+
+	Handle() : index(-1), generation(0) { }
+};
+
+class HandleTable
+{
+	struct Entry
+	{
+		Object* object;
+		unsigned generation;
+		int nextFree;
+	};
+
+	std::vector<Entry> entries;
+	int freeList;
+
+public:
+	HandleTable() : freeList(-1) { }
+
+	Handle Create(Object* object)
+	{
+		if (freeList < 0)
+		{
+			Entry e = { 0, 0, -1 };
+			entries.push_back(e);
+			freeList = (int)entries.size() - 1;
+		}
+		Handle h;
+		h.index = freeList;
+		Entry& e = entries[freeList];
+		freeList = e.nextFree;
+		e.object = object;
+		h.generation = e.generation;
+		return h;
+	}
+
+	void Release(Handle h)
+	{
+		Entry& e = entries[h.index];
+		e.object = 0;
+		e.generation++;		// outstanding handles stop resolving
+		e.nextFree = freeList;
+		freeList = h.index;
+	}
+
+	Object* Get(Handle h)
+	{
+		if (h.index < 0 || h.index >= entries.size()) return 0;
+		const Entry& e = entries[h.index];
+		return e.generation == h.generation ? e.object : 0;
+	}
+};
+
+HandleTable handles;
+
+class Object {
+	friend class EntityStore;
+
+protected:
+	int slot;	// index into entities
+	Handle handle;
+
+	QuadMesh* mesh;
+	unsigned int vao;
+	ShaderProgram* shader;
+
+public:
+	Object(ShaderProgram* sp, OBJECT_TYPE type, QuadMesh* m) : mesh(m), shader(sp)
+	{
+		slot = entities.Add(this, type);
+		handle = handles.Create(this);
+		vao = mesh->Acquire();
+	}
+
+	virtual ~Object()
+	{
+		mesh->Release();
+		handles.Release(handle);
+		entities.Remove(slot);
+	}
+
+	Handle GetHandle() { return handle; }
+
+	void Destroy() { entities.Kill(slot); }
+	bool StillAlive() { return entities.alive[slot] != 0; }
+	vec2 Velocity() { return entities.velocity[slot]; }
+	vec2 Scale() { return entities.scale[slot]; }
+	float AngularVelocity() { return entities.angularVelocity[slot]; };
+	OBJECT_TYPE GetType() { return (OBJECT_TYPE)entities.kind[slot]; }
+
+	void SetPosition(vec2 p) { entities.SetPosition(slot, p); }
+	void SetVelocity(vec2 v) { entities.SetVelocity(slot, v); }
+	void SetScale(vec2 s) { entities.scale[slot] = s; entities.dirty[slot] = 1; }
+	void SetAngularVelocity(float w) { entities.SetAngularVelocity(slot, w); }
+
+	// world transform, valid once the scene has built this frame's transforms
+	const affine2& Transform() { return entities.transform[slot]; }
+
+	mat4 MVP() { return (Transform() * view).ToMat4(); }
+
+	virtual void Draw()
+	{
+		mat4 MVPTransform = MVP();
+		renderer->DrawQuad(shader, MVPTransform, vao, 0, 0);
+	}
+
+	// queue the object into the sprite batch, objects that cannot be batched draw right away
+	virtual void Submit(SpriteBatch&)
+	{
+		Draw();
+	}
+
+	// dt is the tick length in seconds
+	virtual void Control(float dt)
+	{
+
+	}
+
+	virtual bool TooClose(Object* o)
+	{
+		if ((GetPosition() - o->GetPosition()).length() < interactionRadius) return true;
+		return false;
+	}
+
+	vec2 GetPosition()
+	{
+		return entities.position[slot];
+	}
+};
+
+void EntityStore::SwapEntries(int a, int b)
+{
+	if (a == b) return;
+	std::swap(position[a], position[b]);
+	std::swap(velocity[a], velocity[b]);
+	std::swap(scale[a], scale[b]);
+	std::swap(orientation[a], orientation[b]);
+	std::swap(previousPosition[a], previousPosition[b]);
+	std::swap(previousOrientation[a], previousOrientation[b]);
+	std::swap(angularVelocity[a], angularVelocity[b]);
+	std::swap(kind[a], kind[b]);
+	std::swap(alive[a], alive[b]);
+	std::swap(owner[a], owner[b]);
+	std::swap(wrapLimit[a], wrapLimit[b]);
+	std::swap(cullLimit[a], cullLimit[b]);
+	std::swap(transform[a], transform[b]);
+	std::swap(dirty[a], dirty[b]);
+	owner[a]->slot = a;
+	owner[b]->slot = b;
+}
+
+void EntityStore::Remove(int index)
+{
+	// the last awake entry fills the gap so the awake ones stay in front,
+	// then the last entry of all fills that one's place
+	if (index < awake)
+	{
+		SwapEntries(index, --awake);
+		index = awake;
+	}
+	SwapEntries(index, Count() - 1);
+
+	position.pop_back();
+	velocity.pop_back();
+	scale.pop_back();
+	orientation.pop_back();
+	previousPosition.pop_back();
+	previousOrientation.pop_back();
+	angularVelocity.pop_back();
+	kind.pop_back();
+	alive.pop_back();
+	wrapLimit.pop_back();
+	cullLimit.pop_back();
+	transform.pop_back();
+	dirty.pop_back();
+	owner.pop_back();
+}
+
+
+class Quad : public Object {
+public:
+	Quad() : Object(&coloredShader, QUAD, &coloredQuadMesh) { }
+};
+
+
+extern "C" unsigned char* stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
+
+extern "C" unsigned char* stbi_load_from_memory(unsigned char const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+
+extern "C" void stbi_image_free(void *retval_from_stbi_load);
+
+// a fixed set of worker threads taking jobs off one queue. with no workers
+// Submit runs the job right away on the calling thread
+class ThreadPool
+{
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> jobs;
+	std::mutex mutex;
+	std::condition_variable wake, idle;
+	int running;
+	bool stopping;
+
+	void Work()
+	{
+		for (;;)
+		{
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+				if (jobs.empty()) return;
+				job = std::move(jobs.front());
+				jobs.pop_front();
+				running++;
+			}
+			job();
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--running == 0 && jobs.empty()) idle.notify_all();
+		}
+	}
+
+public:
+	ThreadPool() : running(0), stopping(false) { }
+
+	void Start(int threads)
+	{
+		for (int i = 0; i < threads; i++) workers.push_back(std::thread(&ThreadPool::Work, this));
+	}
+
+	int Threads() { return workers.empty() ? 1 : (int)workers.size(); }
+	bool Running() { return !workers.empty(); }
+
+	void Submit(std::function<void()> job)
+	{
+		if (workers.empty()) { job(); return; }
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(std::move(job));
+		wake.notify_one();
+	}
+
+	// blocks until every submitted job has finished
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		idle.wait(lock, [this] { return running == 0 && jobs.empty(); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+			wake.notify_all();
+		}
+		for (int i = 0; i < workers.size(); i++) workers[i].join();
+	}
+};
+
+ThreadPool threadPool;
+int decodeThreads = 0;	// 0 picks one per core, 1 decodes on the main thread
+
+// a whole file mapped read-only into memory
+class MappedFile
+{
+	const unsigned char* data;
+	size_t size;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+	HANDLE file, mapping;
+#endif
+
+public:
+	MappedFile() : data(0), size(0) { }
+
+	bool Open(const std::string& path)
+	{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER length;
+		mapping = NULL;
+		if (GetFileSizeEx(file, &length) && length.QuadPart > 0)
+			mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping) data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!data)
+		{
+			if (mapping) CloseHandle(mapping);
+			CloseHandle(file);
+			return false;
+		}
+		size = (size_t)length.QuadPart;
+#else
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat info;
+		void* view = MAP_FAILED;
+		if (fstat(fd, &info) == 0 && info.st_size > 0)
+			view = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (view == MAP_FAILED) return false;
+		data = (const unsigned char*)view;
+		size = (size_t)info.st_size;
+#endif
+		return true;
+	}
+
+	const unsigned char* Data() { return data; }
+	size_t Size() { return size; }
+
+	~MappedFile()
+	{
+		if (!data) return;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+		UnmapViewOfFile(data);
+		CloseHandle(mapping);
+		CloseHandle(file);
+#else
+		munmap((void*)data, size);
+#endif
+	}
+};
+
+// where the executable lives, so assets are found from any working directory
+std::string executableDir;
+
+void FindExecutableDir(const char* argv0)
+{
+	char path[4096];
+	int length = 0;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+	length = (int)GetModuleFileNameA(NULL, path, sizeof(path));
+	if (length >= (int)sizeof(path)) length = 0;
+#elif defined(__linux__)
+	length = (int)readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if (length < 0) length = 0;
+#endif
+	std::string exe = length > 0 ? std::string(path, length) : std::string(argv0 ? argv0 : "");
+	size_t slash = exe.find_last_of("/\\");
+	executableDir = slash == std::string::npos ? "" : exe.substr(0, slash + 1);
+}
+
+unsigned long long HashBytes(const unsigned char* bytes, size_t size)
+{
+	// FNV-1a
+	unsigned long long hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	return hash;
+}
+
+// every image packed into one file by --pack-assets: a header, an index of
+// fixed size entries and then the files themselves, each starting on a page
+// boundary. the whole archive is mapped once and files are handed out as
+// pointers into the mapping
+struct AssetArchiveHeader
+{
+	char magic[4];		// "PAK1"
+	int version;
+	int count;
+	int reserved;
+};
+
+struct AssetArchiveEntry
+{
+	char name[40];
+	unsigned long long offset;
+	unsigned long long size;
+	unsigned long long hash;	// of the file contents, keys the texture cache
+};
+
+const int assetAlignment = 4096;
+const char* assetArchiveName = "assets.pak";
+
+class AssetArchive
+{
+	MappedFile file;
+	const AssetArchiveEntry* entries;
+	int count;
+
+public:
+	AssetArchive() : entries(0), count(0) { }
+
+	bool Open(const std::string& path)
+	{
+		if (!file.Open(path)) return false;
+		AssetArchiveHeader header;
+		if (file.Size() < sizeof(header)) return false;
+		memcpy(&header, file.Data(), sizeof(header));
+		if (memcmp(header.magic, "PAK1", 4) != 0 || header.version != 1 || header.count < 0 ||
+			file.Size() < sizeof(header) + header.count * sizeof(AssetArchiveEntry))
+		{
+			printf("%s is not an asset archive\n", path.c_str());
+			return false;
+		}
+		entries = (const AssetArchiveEntry*)(file.Data() + sizeof(header));
+		for (int i = 0; i < header.count; i++)
+		{
+			if (entries[i].offset + entries[i].size > file.Size())
+			{
+				printf("%s is truncated\n", path.c_str());
+				entries = 0;
+				return false;
+			}
+		}
+		count = header.count;
+		return true;
+	}
+
+	const AssetArchiveEntry* Find(const std::string& name)
+	{
+		for (int i = 0; i < count; i++)
+			if (strncmp(entries[i].name, name.c_str(), sizeof(entries[i].name)) == 0) return &entries[i];
+		return 0;
+	}
+
+	const unsigned char* Data(const AssetArchiveEntry* entry) { return file.Data() + entry->offset; }
+	int Count() { return count; }
+};
+
+AssetArchive assets;
+
+bool HasImageExtension(const std::string& name)
+{
+	size_t dot = name.find_last_of('.');
+	if (dot == std::string::npos) return false;
+	std::string extension = name.substr(dot + 1);
+	for (int i = 0; i < extension.size(); i++) extension[i] = (char)tolower(extension[i]);
+	return extension == "png" || extension == "jpg" || extension == "jpeg";
+}
+
+std::vector<std::string> ListImages(const std::string& dir)
+{
+	std::vector<std::string> names;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+	WIN32_FIND_DATAA found;
+	HANDLE search = FindFirstFileA((dir + "/*").c_str(), &found);
+	if (search != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && HasImageExtension(found.cFileName))
+				names.push_back(found.cFileName);
+		} while (FindNextFileA(search, &found));
+		FindClose(search);
+	}
+#else
+	DIR* listing = opendir(dir.c_str());
+	if (listing)
+	{
+		while (dirent* found = readdir(listing))
+		{
+			if (!HasImageExtension(found->d_name)) continue;
+			// stat rather than d_type, which some filesystems leave unknown
+			struct stat info;
+			if (stat((dir + "/" + found->d_name).c_str(), &info) == 0 && S_ISREG(info.st_mode))
+				names.push_back(found->d_name);
+		}
+		closedir(listing);
+	}
+#endif
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+// --pack-assets: bundles the images in dir into assets.pak next to the executable
+int PackAssets(const std::string& dir)
+{
+	std::vector<std::string> names = ListImages(dir);
+	std::string outPath = executableDir + assetArchiveName;
+	FILE* out = fopen(outPath.c_str(), "wb");
+	if (!out) { printf("cannot write %s\n", outPath.c_str()); return 1; }
+
+	AssetArchiveHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "PAK1", 4);
+	header.version = 1;
+	std::vector<AssetArchiveEntry> entries;
+	std::vector<std::vector<unsigned char>> contents;
+	for (int i = 0; i < names.size(); i++)
+	{
+		if (names[i].size() >= sizeof(AssetArchiveEntry().name)) { printf("%s: name too long, skipped\n", names[i].c_str()); continue; }
+		FILE* in = fopen((dir + "/" + names[i]).c_str(), "rb");
+		if (!in) { printf("cannot read %s\n", names[i].c_str()); continue; }
+		std::vector<unsigned char> bytes;
+		unsigned char chunk[65536];
+		size_t got;
+		while ((got = fread(chunk, 1, sizeof(chunk), in)) > 0) bytes.insert(bytes.end(), chunk, chunk + got);
+		fclose(in);
+
+		AssetArchiveEntry entry;
+		memset(&entry, 0, sizeof(entry));
+		strcpy(entry.name, names[i].c_str());
+		entry.size = bytes.size();
+		entry.hash = HashBytes(bytes.data(), bytes.size());
+		entries.push_back(entry);
+		contents.push_back(bytes);
+	}
+	header.count = (int)entries.size();
+
+	unsigned long long offset = sizeof(header) + entries.size() * sizeof(AssetArchiveEntry);
+	for (int i = 0; i < entries.size(); i++)
+	{
+		offset = (offset + assetAlignment - 1) / assetAlignment * assetAlignment;
+		entries[i].offset = offset;
+		offset += entries[i].size;
+	}
+
+	bool written = fwrite(&header, sizeof(header), 1, out) == 1 &&
+		(entries.empty() || fwrite(entries.data(), sizeof(AssetArchiveEntry), entries.size(), out) == entries.size());
+	std::vector<unsigned char> zeros(assetAlignment, 0);
+	for (int i = 0; i < entries.size() && written; i++)
+	{
+		long position = ftell(out);
+		written = fwrite(zeros.data(), 1, (size_t)(entries[i].offset - position), out) == entries[i].offset - position &&
+			fwrite(contents[i].data(), 1, contents[i].size(), out) == contents[i].size();
+	}
+	written = fclose(out) == 0 && written;
+	if (!written) { printf("writing %s failed\n", outPath.c_str()); remove(outPath.c_str()); return 1; }
+	printf("packed %d images, %llu bytes, into %s\n", (int)entries.size(), offset, outPath.c_str());
+	return 0;
+}
+
+// stb_image allocates a handful of buffers per image: the compressed data
+// and the zlib output, both grown by realloc, the unfiltered rows and the
+// final pixels. during a load they all come from one arena, a bump allocator
+// over a few large chunks that goes back to imageArenas in one piece once the
+// image is uploaded. a reset arena keeps a single chunk as large as its last
+// load needed, up to imageArenaKeep, so reusing it for a similar load costs no
+// further trips to malloc. the pool is emptied once loading is over
+class ImageArena;
+
+// in front of every block stb_image gets, arena or not, so a free or realloc
+// always knows where the block came from
+struct ImageBlock
+{
+	size_t size;
+	ImageArena* arena;	// NULL when it came straight from malloc
+};
+const size_t imageBlockHeader = 16;	// keeps arena blocks 16 byte aligned, malloc ones as aligned as malloc
+const size_t imageArenaKeep = 1 << 20;	// most a reset arena holds on to
+
+struct ImageArenaStats
+{
+	std::atomic<int> allocations;		// stb_image's malloc and realloc calls
+	std::atomic<int> systemAllocations;	// chunks and blocks taken from malloc
+	std::atomic<long long> live, peak;	// bytes in use over all arenas
+};
+ImageArenaStats imageArenaStats;
+
+void CountImageBytes(long long bytes)
+{
+	long long live = imageArenaStats.live += bytes;
+	long long peak = imageArenaStats.peak;
+	while (live > peak && !imageArenaStats.peak.compare_exchange_weak(peak, live)) { }
+}
+
+class ImageArena
+{
+	struct Chunk
+	{
+		unsigned char* allocation;	// what malloc returned, for free
+		unsigned char* memory;		// rounded up to 16 bytes, malloc only promises 8 on 32 bit
+		size_t size, used;
+	};
+
+	std::vector<Chunk> chunks;
+	size_t used, peak;
+	ImageBlock* last;	// the only block that can grow or be given back in place
+
+	static size_t Footprint(size_t size) { return imageBlockHeader + ((size + 15) & ~(size_t)15); }
+
+	void AddChunk(size_t size)
+	{
+		unsigned char* allocation = (unsigned char*)malloc(size + 15);
+		if (!allocation) return;
+		Chunk chunk = { allocation, (unsigned char*)(((size_t)allocation + 15) & ~(size_t)15), size, 0 };
+		chunks.push_back(chunk);
+		imageArenaStats.systemAllocations++;
+	}
+
+public:
+	ImageArena() : used(0), peak(0), last(0) { }
+
+	void* Allocate(size_t size)
+	{
+		size_t footprint = Footprint(size);
+		if (chunks.empty() || chunks.back().used + footprint > chunks.back().size)
+		{
+			size_t chunkSize = chunks.empty() ? 1 << 20 : chunks.back().size * 2;
+			AddChunk(chunkSize > footprint ? chunkSize : footprint);
+			if (chunks.empty() || chunks.back().used + footprint > chunks.back().size) return NULL;
+		}
+		Chunk& chunk = chunks.back();
+		ImageBlock* block = (ImageBlock*)(chunk.memory + chunk.used);
+		block->size = size;
+		block->arena = this;
+		chunk.used += footprint;
+		used += footprint;
+		if (used > peak) peak = used;
+		CountImageBytes((long long)footprint);
+		last = block;
+		return (unsigned char*)block + imageBlockHeader;
+	}
+
+	void* Reallocate(void* p, size_t size)
+	{
+		ImageBlock* block = (ImageBlock*)((unsigned char*)p - imageBlockHeader);
+		if (block == last)
+		{
+			// the last block grows in place while its chunk has room
+			Chunk& chunk = chunks.back();
+			size_t oldFootprint = Footprint(block->size), newFootprint = Footprint(size);
+			if (chunk.used - oldFootprint + newFootprint <= chunk.size)
+			{
+				chunk.used = chunk.used - oldFootprint + newFootprint;
+				used = used - oldFootprint + newFootprint;
+				if (used > peak) peak = used;
+				CountImageBytes((long long)newFootprint - (long long)oldFootprint);
+				block->size = size;
+				return p;
+			}
+		}
+		void* moved = Allocate(size);
+		if (!moved) return NULL;
+		memcpy(moved, p, block->size < size ? block->size : size);
+		Free(p);
+		return moved;
+	}
+
+	// only the last block is actually given back, the rest wait for Reset
+	void Free(void* p)
+	{
+		ImageBlock* block = (ImageBlock*)((unsigned char*)p - imageBlockHeader);
+		if (block != last) return;
+		size_t footprint = Footprint(block->size);
+		chunks.back().used -= footprint;
+		used -= footprint;
+		CountImageBytes(-(long long)footprint);
+		last = NULL;
+	}
+
+	void Reset()
+	{
+		CountImageBytes(-(long long)used);
+		if (chunks.size() > 1 || (!chunks.empty() && chunks[0].size > imageArenaKeep))
+		{
+			// next time the whole load fits in one chunk, unless it was a big one
+			for (int i = 0; i < chunks.size(); i++) ::free(chunks[i].allocation);
+			chunks.clear();
+			size_t keep = peak < imageArenaKeep ? peak : imageArenaKeep;
+			if (keep > 0) AddChunk(keep);
+		}
+		if (!chunks.empty()) chunks[0].used = 0;
+		used = 0;
+		peak = 0;
+		last = NULL;
+	}
+
+	~ImageArena()
+	{
+		CountImageBytes(-(long long)used);
+		for (int i = 0; i < chunks.size(); i++) ::free(chunks[i].allocation);
+	}
+};
+
+// reset arenas waiting for the next load, a few are kept between loads
+class ImageArenaPool
+{
+	std::mutex mutex;
+	std::vector<ImageArena*> idle;
+
+public:
+	ImageArena* Get()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (idle.empty()) return new ImageArena();
+		ImageArena* arena = idle.back();
+		idle.pop_back();
+		return arena;
+	}
+
+	void Put(ImageArena* arena)
+	{
+		arena->Reset();
+		std::lock_guard<std::mutex> lock(mutex);
+		if (idle.size() < 4) idle.push_back(arena);
+		else delete arena;
+	}
+
+	// gives every idle arena back to the system, for when loading is over
+	void Trim()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int i = 0; i < idle.size(); i++) delete idle[i];
+		idle.clear();
+	}
+
+	~ImageArenaPool()
+	{
+		Trim();
+	}
+};
+
+ImageArenaPool imageArenas;
+thread_local ImageArena* loadingArena = 0;	// set by ReadImage around the stb_image call
+
+// the allocation hooks stb_image.c is built with
+extern "C" void* stbi_arena_malloc(size_t size)
+{
+	imageArenaStats.allocations++;
+	if (loadingArena) return loadingArena->Allocate(size);
+	ImageBlock* block = (ImageBlock*)malloc(imageBlockHeader + size);
+	if (!block) return NULL;
+	imageArenaStats.systemAllocations++;
+	block->size = size;
+	block->arena = NULL;
+	return (unsigned char*)block + imageBlockHeader;
+}
+
+extern "C" void stbi_arena_free(void* p)
+{
+	if (!p) return;
+	ImageBlock* block = (ImageBlock*)((unsigned char*)p - imageBlockHeader);
+	if (block->arena) block->arena->Free(p);
+	else free(block);
+}
+
+extern "C" void* stbi_arena_realloc(void* p, size_t size)
+{
+	if (!p) return stbi_arena_malloc(size);
+	imageArenaStats.allocations++;
+	ImageBlock* block = (ImageBlock*)((unsigned char*)p - imageBlockHeader);
+	if (block->arena) return block->arena->Reallocate(p, size);
+	block = (ImageBlock*)realloc(block, imageBlockHeader + size);
+	if (!block) return NULL;
+	imageArenaStats.systemAllocations++;
+	block->size = size;
+	return (unsigned char*)block + imageBlockHeader;
+}
+
+struct DecodedImage
+{
+	std::string path;
+	const unsigned char* data;	// RGBA, NULL if the file could not be read
+	int width, height;
+	MappedFile* cached;			// holds data when it came from the texture cache
+	ImageArena* arena;			// holds data when stb_image decoded it
+
+	void Free()
+	{
+		if (cached) delete cached;
+		else if (arena) imageArenas.Put(arena);	// the pixels go with the arena
+		else if (data) stbi_image_free((void*)data);
+		data = NULL;
+		cached = NULL;
+		arena = NULL;
+	}
+};
+
+// what the texture cache knows about where an image came from
+struct ImageSource
+{
+	std::string path;				// the loose file, empty when packed
+	const unsigned char* packed;	// the file inside the asset archive
+	long long time, size;
+	unsigned long long hash;		// only known up front for packed files
+};
+
+// decoded images are kept in textureCacheDir as a small header followed by
+// the RGBA pixels. a packed image's entry is used while its hash matches the
+// one in the archive index. a loose file's entry is used while the file keeps
+// its mtime and size; if those change the file is hashed and the entry
+// survives a touch that left the contents alone
+std::string textureCacheDir = "texcache";
+bool textureCacheEnabled = true;
+std::atomic<int> textureCacheHits(0);
+
+struct TextureCacheHeader
+{
+	char magic[4];			// "RGBA"
+	int version;
+	int width, height;
+	long long sourceTime;
+	long long sourceSize;
+	unsigned long long sourceHash;
+	char padding[24];		// keeps the pixels 64 byte aligned
+};
+
+bool HashFile(const std::string& path, unsigned long long& hash)
+{
+	MappedFile source;
+	if (!source.Open(path)) return false;
+	hash = HashBytes(source.Data(), source.Size());
+	return true;
+}
+
+std::string TextureCachePath(const std::string& path)
+{
+	std::string name = path;
+	for (int i = 0; i < name.size(); i++)
+		if (name[i] == '/' || name[i] == '\\' || name[i] == ':') name[i] = '_';
+	return textureCacheDir + "/" + name + ".rgba";
+}
+
+bool ReadTextureCache(DecodedImage& image, const ImageSource& source)
+{
+	std::string cachePath = TextureCachePath(image.path);
+	MappedFile* file = new MappedFile();
+	TextureCacheHeader header;
+	bool valid = file->Open(cachePath) && file->Size() >= sizeof(header);
+	if (valid)
+	{
+		memcpy(&header, file->Data(), sizeof(header));
+		valid = memcmp(header.magic, "RGBA", 4) == 0 && header.version == 1 &&
+			file->Size() == sizeof(header) + (size_t)header.width * header.height * 4;
+	}
+	if (valid && source.packed) valid = header.sourceHash == source.hash;
+	else if (valid && (header.sourceTime != source.time || header.sourceSize != source.size))
+	{
+		unsigned long long hash;
+		valid = HashFile(source.path, hash) && hash == header.sourceHash;
+		if (valid)
+		{
+			// same contents under a new mtime, remember it so the next start skips the hash.
+			// the mapping goes first, Windows will not open a mapped file for writing
+			size_t size = file->Size();
+			delete file;
+			header.sourceTime = source.time;
+			header.sourceSize = source.size;
+			FILE* out = fopen(cachePath.c_str(), "r+b");
+			if (out) { fwrite(&header, sizeof(header), 1, out); fclose(out); }
+			else printf("cannot update %s\n", cachePath.c_str());
+			file = new MappedFile();
+			valid = file->Open(cachePath) && file->Size() == size;
+		}
+	}
+	if (!valid) { delete file; return false; }
+
+	image.data = file->Data() + sizeof(header);
+	image.width = header.width;
+	image.height = header.height;
+	image.cached = file;
+	return true;
+}
+
+void WriteTextureCache(const DecodedImage& image, const ImageSource& source)
+{
+	TextureCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "RGBA", 4);
+	header.version = 1;
+	header.width = image.width;
+	header.height = image.height;
+	header.sourceTime = source.time;
+	header.sourceSize = source.size;
+	header.sourceHash = source.hash;
+	if (!source.packed && !HashFile(source.path, header.sourceHash)) return;
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+	_mkdir(textureCacheDir.c_str());
+#else
+	mkdir(textureCacheDir.c_str(), 0755);
+#endif
+	// written aside and renamed so a crash never leaves a half entry behind
+	std::string cachePath = TextureCachePath(image.path);
+	std::string partial = cachePath + ".part";
+	FILE* out = fopen(partial.c_str(), "wb");
+	if (!out) return;
+	bool written = fwrite(&header, sizeof(header), 1, out) == 1 &&
+		fwrite(image.data, (size_t)image.width * image.height * 4, 1, out) == 1;
+	written = fclose(out) == 0 && written;
+	remove(cachePath.c_str());
+	if (!written || rename(partial.c_str(), cachePath.c_str()) != 0) remove(partial.c_str());
+}
+
+// finds an image in the asset archive, or as a loose file relative to the
+// working directory and then to the executable
+bool FindImage(const std::string& name, ImageSource& source)
+{
+	const AssetArchiveEntry* entry = assets.Find(name);
+	if (entry)
+	{
+		source.packed = assets.Data(entry);
+		source.time = 0;
+		source.size = (long long)entry->size;
+		source.hash = entry->hash;
+		return true;
+	}
+
+	source.packed = NULL;
+	source.hash = 0;
+	const std::string candidates[] = { name, executableDir + name };
+	for (int i = 0; i < 2; i++)
+	{
+		struct stat info;
+		if (stat(candidates[i].c_str(), &info) != 0) continue;
+		source.path = candidates[i];
+		source.time = (long long)info.st_mtime;
+		source.size = (long long)info.st_size;
+		return true;
+	}
+	return false;
+}
+
+void ReadImage(DecodedImage& image)
+{
+	PROFILE_SCOPE("read image");
+	ImageSource source;
+	if (!FindImage(image.path, source)) return;
+	if (textureCacheEnabled && ReadTextureCache(image, source))
+	{
+		textureCacheHits++;
+		return;
+	}
+
+	int nComponents;
+	image.arena = imageArenas.Get();
+	loadingArena = image.arena;
+	if (source.packed)
+		image.data = stbi_load_from_memory(source.packed, (int)source.size, &image.width, &image.height, &nComponents, 4);
+	else
+		image.data = stbi_load(source.path.c_str(), &image.width, &image.height, &nComponents, 4);
+	loadingArena = NULL;
+	if (!image.data) image.Free();
+	if (image.data && textureCacheEnabled) WriteTextureCache(image, source);
+}
+
+// loads every image on the pool, from the texture cache where it can,
+// the GL upload is left to the caller
+void DecodeImages(std::vector<DecodedImage>& images)
+{
+	for (int i = 0; i < images.size(); i++)
+	{
+		DecodedImage* image = &images[i];
+		threadPool.Submit([image] { ReadImage(*image); });
+	}
+	threadPool.Wait();
+}
+
+class Texture
+{
+	unsigned int textureId;
+	float rect[4];	// offset and size of the image inside textureId
+	bool owned;		// atlas pages belong to the atlas
+
+public:
+	Texture(const std::string& inputFileName) : textureId(0), owned(true)
+	{
+		PROFILE_SCOPE("Texture load");
+		rect[0] = 0; rect[1] = 0; rect[2] = 1; rect[3] = 1;
+
+		DecodedImage image = { inputFileName, NULL, 0, 0, NULL, NULL };
+		ReadImage(image);
+
+		if (image.data == NULL)
+		{
+			return;
+		}
+
+		textureId = renderer->CreateTexture(image.width, image.height, image.data);
+
+		image.Free();
+	}
+
+	// a sub-rectangle of an atlas page
+	Texture(unsigned int page, float u, float v, float w, float h) : textureId(page), owned(false)
+	{
+		rect[0] = u; rect[1] = v; rect[2] = w; rect[3] = h;
+	}
+
+	~Texture()
+	{
+		if (owned && textureId) renderer->DeleteTexture(textureId);
+	}
+
+	// takes over a whole texture, replacing the placeholder of a streamed one
+	void Assign(unsigned int texture)
+	{
+		textureId = texture;
+		owned = true;
+		rect[0] = 0; rect[1] = 0; rect[2] = 1; rect[3] = 1;
+	}
+
+	unsigned int Id() { return textureId; }
+	const float* Rect() { return rect; }
+};
+
+// packs images into as few textures as possible with a shelf packer, so that
+// sprites drawn from different images can share one texture bind
+class TextureAtlas
+{
+	std::vector<unsigned int> pages;
+	std::vector<std::string> names;
+	std::vector<Texture*> regions;
+
+public:
+	// packs and uploads images that are already decoded, then frees them
+	void Build(std::vector<DecodedImage>& decoded)
+	{
+		PROFILE_SCOPE("TextureAtlas::Build");
+		struct Image
+		{
+			const unsigned char* data;
+			int width, height;
+			int x, y, page;
+		};
+		const int padding = 2;
+
+		int maxSize = renderer->MaxTextureSize();
+		int pageSize = maxSize < 2048 ? maxSize : 2048;
+
+		int count = (int)decoded.size();
+		std::vector<Image> images(count);
+		std::vector<int> order;
+		for (int i = 0; i < count; i++)
+		{
+			Image& image = images[i];
+			image.data = decoded[i].data;
+			image.width = decoded[i].width;
+			image.height = decoded[i].height;
+			image.page = -1;
+			if (image.data == NULL) { printf("cannot load %s\n", decoded[i].path.c_str()); continue; }
+			if (image.width + 2 * padding > maxSize || image.height + 2 * padding > maxSize)
+			{
+				printf("%s does not fit into a texture\n", decoded[i].path.c_str());
+				continue;
+			}
+			if (image.width + 2 * padding > pageSize) pageSize = image.width + 2 * padding;
+			if (image.height + 2 * padding > pageSize) pageSize = image.height + 2 * padding;
+			order.push_back(i);
+		}
+
+		// tallest first keeps the shelves tight
+		std::sort(order.begin(), order.end(), [&](int a, int b) { return images[a].height > images[b].height; });
+
+		std::vector<int> pageHeights;
+		int x = padding, y = padding, shelfHeight = 0;
+		if (!order.empty()) pageHeights.push_back(0);
+		for (int i = 0; i < order.size(); i++)
+		{
+			Image& image = images[order[i]];
+			if (x + image.width + padding > pageSize)
+			{
+				x = padding;
+				y += shelfHeight + padding;
+				shelfHeight = 0;
+			}
+			if (y + image.height + padding > pageSize)
+			{
+				pageHeights.push_back(0);
+				x = padding;
+				y = padding;
+				shelfHeight = 0;
+			}
+			image.x = x;
+			image.y = y;
+			image.page = (int)pageHeights.size() - 1;
+			x += image.width + padding;
+			if (image.height > shelfHeight) shelfHeight = image.height;
+			pageHeights.back() = y + shelfHeight + padding;
+		}
+
+		int firstPage = (int)pages.size();
+		for (int p = 0; p < pageHeights.size(); p++)
+		{
+			// cleared so the padding between images stays transparent
+			std::vector<unsigned char> clear(pageSize * pageHeights[p] * 4, 0);
+			pages.push_back(renderer->CreateTexture(pageSize, pageHeights[p], clear.data()));
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			Image& image = images[i];
+			names.push_back(decoded[i].path);
+			if (image.page < 0)
+			{
+				// keep a region so callers still get a texture, it just samples nothing
+				decoded[i].Free();
+				regions.push_back(new Texture(0, 0, 0, 1, 1));
+				continue;
+			}
+
+			renderer->UpdateTexture(pages[firstPage + image.page], image.x, image.y, image.width, image.height, image.data);
+			decoded[i].Free();
+
+			// inset by half a texel so linear filtering never reaches the neighbours
+			float w = (float)pageSize, h = (float)pageHeights[image.page];
+			regions.push_back(new Texture(pages[firstPage + image.page],
+				(image.x + 0.5f) / w, (image.y + 0.5f) / h,
+				(image.width - 1) / w, (image.height - 1) / h));
+		}
+
+		printf("atlas: %d images in %d pages, %d texels wide\n", (int)order.size(), (int)pageHeights.size(), pageSize);
+	}
+
+	Texture* Get(const std::string& name)
+	{
+		for (int i = 0; i < names.size(); i++)
+			if (names[i] == name) return regions[i];
+		return 0;
+	}
+
+	void Clear()
+	{
+		for (int i = 0; i < regions.size(); i++) delete regions[i];
+		for (int i = 0; i < pages.size(); i++) renderer->DeleteTexture(pages[i]);
+		regions.clear();
+		pages.clear();
+		names.clear();
+	}
+
+	~TextureAtlas()
+	{
+		Clear();
+	}
+};
+
+// collects textured quads into one bucket per texture page, the backend then
+// draws every bucket with a single instanced call from a shared instance buffer
+class SpriteBatch
+{
+	struct Bucket
+	{
+		unsigned int page;
+		std::vector<SpriteInstance> instances;
+	};
+
+	std::vector<Bucket> buckets;
+	std::vector<SpriteInstance> staging;
+	std::vector<SpriteRange> ranges;
+
+public:
+	int drawCalls;
+
+	SpriteBatch() : drawCalls(0) { }
+
+	void Add(Texture* texture, const affine2& transform)
+	{
+		Bucket* bucket = 0;
+		for (int i = 0; i < buckets.size(); i++)
+			if (buckets[i].page == texture->Id()) { bucket = &buckets[i]; break; }
+		if (!bucket)
+		{
+			buckets.push_back(Bucket());
+			bucket = &buckets.back();
+			bucket->page = texture->Id();
+		}
+
+		SpriteInstance instance;
+		instance.transform = transform;
+		for (int k = 0; k < 4; k++) instance.rect[k] = texture->Rect()[k];
+		bucket->instances.push_back(instance);
+	}
+
+	void Flush()
+	{
+		staging.clear();
+		ranges.clear();
+		for (int i = 0; i < buckets.size(); i++)
+		{
+			if (buckets[i].instances.empty()) continue;
+
+			SpriteRange range;
+			range.page = buckets[i].page;
+			range.first = (int)staging.size();
+			range.count = (int)buckets[i].instances.size();
+			ranges.push_back(range);
+
+			staging.insert(staging.end(), buckets[i].instances.begin(), buckets[i].instances.end());
+			buckets[i].instances.clear();
+		}
+
+		drawCalls = (int)ranges.size();
+		if (!staging.empty()) renderer->DrawSprites(staging.data(), (int)staging.size(), ranges.data(), (int)ranges.size());
+	}
+};
+
+class TexturedQuad : public Object
+{
+protected:
+	Texture *texture;
+
+public:
+
+	TexturedQuad(Texture* t, OBJECT_TYPE type, ShaderProgram* sp = &texturedShader) : Object(sp, type, &texturedQuadMesh), texture(t) { }
+
+	virtual void Draw()
+	{
+		mat4 MVPTransform = MVP();
+		renderer->DrawQuad(shader, MVPTransform, vao, texture->Id(), texture->Rect());
+	}
+
+	virtual void Submit(SpriteBatch& batch)
+	{
+		batch.Add(texture, Transform());
+	}
+};
+
+// slab allocator for one object type: slots come from fixed-size slabs and
+// freed slots are handed out again before a new slab is allocated
+template <typename T, int slotsPerSlab = 64>
+class ObjectPool
+{
+	union Slot
+	{
+		Slot* next;
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+	};
+
+	std::vector<Slot*> slabs;
+	Slot* freeList;
+
+public:
+	int live;
+
+	ObjectPool() : freeList(0), live(0) { }
+
+	void* Allocate()
+	{
+		if (!freeList)
+		{
+			Slot* slab = new Slot[slotsPerSlab];
+			for (int i = 0; i < slotsPerSlab; i++)
+			{
+				slab[i].next = freeList;
+				freeList = &slab[i];
+			}
+			slabs.push_back(slab);
+		}
+		Slot* slot = freeList;
+		freeList = slot->next;
+		live++;
+		return slot;
+	}
+
+	void Free(void* p)
+	{
+		Slot* slot = (Slot*)p;
+		slot->next = freeList;
+		freeList = slot;
+		live--;
+	}
+
+	int Capacity() { return (int)slabs.size() * slotsPerSlab; }
+
+	~ObjectPool()
+	{
+		for (int i = 0; i < slabs.size(); i++) delete[] slabs[i];
+	}
+};
+
+// gives T a class-specific new and delete that draw from its own pool
+template <typename T>
+class Pooled
+{
+public:
+	static ObjectPool<T>& Pool()
+	{
+		// never destroyed: objects may still be deleted by global destructors at exit
+		static ObjectPool<T>* pool = new ObjectPool<T>();
+		return *pool;
+	}
+
+	static void* operator new(size_t size)
+	{
+		assert(size == sizeof(T));
+		return Pool().Allocate();
+	}
+
+	static void operator delete(void* p)
+	{
+		if (p) Pool().Free(p);
+	}
+};
+
+boolean landed = false;
+int lives = 3;
+boolean keyDown = false;
+
+vec2 posn;
+
+boolean hit = false;
+vec2 hitPosition;
+
+class Afterburner : public TexturedQuad
+{
+public:
+
+	Afterburner(Texture* t) : TexturedQuad(t, AFTERBURNER)
+	{
+		SetScale(vec2(0.3, 0.3));
+		SetPosition(vec2(posn.x, posn.y - 0.1));
+	}
+
+	void Control(float dt)
+	{
+		SetPosition(vec2(posn.x -0.04, posn.y - 0.25));
+	}
+
+	virtual void Draw()
+	{
+		if (keyDown) {
+			mat4 MVPTransform = MVP();
+			renderer->DrawQuad(shader, MVPTransform, vao, texture->Id(), texture->Rect());
+		}
+	}
+
+	virtual void Submit(SpriteBatch& batch)
+	{
+		if (keyDown) batch.Add(texture, Transform());
+	}
+};
+
+class Lander : public TexturedQuad
+{
+
+public:
+	static const OBJECT_TYPE kind = LANDER, reactsTo = FIREBALL;
+
+	Lander(Texture* t) : TexturedQuad(t, LANDER)
+	{
+		SetScale(vec2(0.3, 0.3));
+		SetPosition(vec2(0.0, 0.7));
+	}
+
+	void Control(float dt)
+	{
+		if (lives == 0) Destroy();
+		if (!landed) {
+			// thrust and gravity were tuned as per tick changes at 60 Hz
+			float thrust = 0.01f * dt * 60, gravity = 0.003f * dt * 60;
+
+			SetAngularVelocity(0.0);
+			
+			if (keyPressed['a']) {
+				SetVelocity(Velocity() + vec2(-thrust, 0));
+				SetAngularVelocity(AngularVelocity() + 20.0);
+			}
+			if (keyPressed['d']) {
+				SetVelocity(Velocity() + vec2(thrust, 0));
+				SetAngularVelocity(AngularVelocity() - 20.0);
+			}
+			if (keyPressed['w']) {
+				SetVelocity(Velocity() + vec2(0, thrust));
+			}
+			if (keyPressed['s']) {
+				SetVelocity(Velocity() + vec2(0, -thrust));
+			}
+			SetVelocity(Velocity() + vec2(0, -gravity));
+		}
+		else {
+			SetVelocity(vec2(0.0, 0.0));
+			SetAngularVelocity(0.0);
+		}
+		posn = GetPosition();
+	}
+
+	void OnContact(Object* o)
+	{
+		if (TooClose(o))
+		{
+			o->Destroy();
+			lives -= 1;
+			hit = true;
+			hitPosition = o->GetPosition();
+		}
+	}
+};
+
+class Life : public TexturedQuad
+{
+public:
+
+	Life(Texture* t, int place) : TexturedQuad(t, LIFE)
+	{
+		SetScale(vec2(0.1, 0.1));
+		SetPosition(vec2(-1 + (place *.1), .75));
+	}
+};
+
+class DiamondCount : public TexturedQuad, public Pooled<DiamondCount>
+{
+public:
+
+	DiamondCount(Texture* t, int place) : TexturedQuad(t, DIAMONDCOUNT)
+	{
+		SetScale(vec2(0.1, 0.1));
+		SetPosition(vec2(1 - (place *.1), .75));
+	}
+};
+
+boolean newDiamond = false;
+int diamonds = 0;
+
+class Diamond : public TexturedQuad
+{
+public:
+	static const OBJECT_TYPE kind = DIAMOND, reactsTo = LANDER;
+
+	Diamond(Texture* t) : TexturedQuad(t, DIAMOND)
+	{
+		SetScale(vec2(0.05, 0.05));
+		SetPosition(vec2::random());
+		SetVelocity(vec2(0.0, -0.1));
+	}
+
+	void OnContact(Object* o)
+	{
+		if (TooClose(o))
+		{
+			Destroy();
+			newDiamond = true;
+			diamonds += 1;
+		}
+	}
+};
+
+// shown where a fireball hits the lander, fades out by itself
+class Boom : public TexturedQuad, public Pooled<Boom>
+{
+	float age;
+
+public:
+	Boom(Texture* t, vec2 posn) : TexturedQuad(t, BOOM), age(0)
+	{
+		SetScale(vec2(0.2, 0.2));
+		SetPosition(posn);
+	}
+
+	void Control(float dt)
+	{
+		age += dt;
+		if (age > 0.5f) Destroy();
+	}
+};
+
+class Fireball : public TexturedQuad
+{
+
+public:
+	Fireball(Texture* t) : TexturedQuad(t, FIREBALL)
+	{
+		SetScale(vec2(0.1, 0.1));
+		SetVelocity(vec2::random());
+		//orientation = atan(velocity.y / velocity.x);
+		SetPosition(vec2::random());
+	}
+};
+
+class Platform : public TexturedQuad
+{
+
+public:
+	static const OBJECT_TYPE kind = PLATFORM, reactsTo = LANDER;
+
+	Platform(Texture* t) : TexturedQuad(t, PLATFORM)
+	{
+		SetScale(vec2(0.5, 0.1));
+		SetPosition(vec2(0.5, -0.9));
+	}
+
+	void OnContact(Object* o)
+	{
+		if (TooClose(o))
+		{
+			if (o->Velocity().y > -0.5) landed = true;
+			else o->Destroy();
+		}
+	}
+};
+
+class PlatformEnd : public TexturedQuad
+{
+
+public:
+	PlatformEnd(Texture* t, vec2 posn, vec2 platformscale, int side) : TexturedQuad(t, PLATFORMEND)
+	{
+		SetScale(vec2(0.1, platformscale.y));
+		if (side == 1) { 
+			SetPosition(vec2(posn.x + .3, posn.y));
+			SetScale(vec2(-0.1, platformscale.y));
+		}
+		else SetPosition(vec2(posn.x - .3, posn.y));
+		
+	}
+};
+
+class Flipper : public TexturedQuad
+{
+public:
+	static const OBJECT_TYPE kind = FLIPPER, reactsTo = LANDER;
+
+	Flipper(Texture* t) : TexturedQuad(t, FLIPPER)
+	{
+		SetScale(vec2(0.5, 0.1));
+		SetPosition(vec2(-0.5, -0.7));
+	}
+
+	void OnContact(Object* o)
+	{
+		if (TooClose(o))
+		{
+			vec2 old = o->Velocity();
+			o->SetVelocity(vec2(old.x, old.y * -1));
+		}
+	}
+};
+
+boolean caught = false;
+
+class Pokeball : public TexturedQuad, public Pooled<Pokeball>
+{
+public:
+	static const OBJECT_TYPE kind = POKEBALL, reactsTo = SKUNTANK;
+
+	Pokeball(Texture* t, vec2 posn) : TexturedQuad(t, POKEBALL)
+	{
+		SetScale(vec2(0.1, 0.1));
+		SetPosition(posn);
+		
+		float mx = ((mouseX - (windowWidth/2))/1000) *2;
+		float my = -((mouseY - (windowHeight/2))/1000) *2;
+
+		vec2 click = vec2(mx, my);
+		
+		float distance = sqrt(pow(click.x - posn.x, 2) + pow(click.y - posn.y, 2));
+		float directionX = (click.x - posn.x) / distance;
+		float directionY = (click.y - posn.y) / distance;
+
+		SetVelocity(vec2(directionX, directionY));
+	}
+
+	void OnContact(Object* o)
+	{
+		if (TooClose(o)) {
+			caught = true;
+			Destroy();
+		}			
+	}
+};
+
+class FlameThrower : public TexturedQuad, public Pooled<FlameThrower>
+{
+public:
+	FlameThrower(Texture* t, vec2 posn) : TexturedQuad(t, FLAMETHROWER)
+	{
+		SetScale(vec2(0.1, 0.1));
+		SetPosition(posn);
+
+		float mx = ((mouseX - (windowWidth / 2)) / 1000) * 2;
+		float my = -((mouseY - (windowHeight / 2)) / 1000) * 2;
+
+		vec2 click = vec2(mx, my);
+
+		float distance = sqrt(pow(click.x - posn.x, 2) + pow(click.y - posn.y, 2));
+		float directionX = (click.x - posn.x) / distance;
+		float directionY = (click.y - posn.y) / distance;
+
+		SetVelocity(vec2(directionX, directionY));
+	}
+};
+
+class Skuntank : public TexturedQuad
+{
+public:
+	static const OBJECT_TYPE kind = SKUNTANK, reactsTo = POKEBALL;
+
+	Skuntank(Texture* t) : TexturedQuad(t, SKUNTANK)
+	{
+		SetScale(vec2(0.3, 0.3));
+		SetPosition(vec2(-0.3, -0.6));
+	}
+
+	void OnContact(Object* o)
+	{
+		if (TooClose(o)) {
+			Destroy();
+		}
+	}
+};
+
+// collision responses are looked up by the kinds of the two objects instead of
+// asking every object about every neighbour. A class takes part by declaring
+// its kind, the kind it reacts to and a non-virtual OnContact, and by being
+// listed in the table below.
+typedef void (*ContactHandler)(Object* self, Object* other);
+
+template <typename T>
+void Contact(Object* self, Object* other)
+{
+	static_cast<T*>(self)->OnContact(other);
+}
+
+static_assert(OBJECT_TYPE_COUNT <= 32, "interaction masks hold one bit per kind");
+
+template <typename... Types>
+class InteractionTable
+{
+	template <typename T>
+	void Register()
+	{
+		handler[T::kind][T::reactsTo] = &Contact<T>;
+		mask[T::kind] |= 1u << T::reactsTo;
+		mask[T::reactsTo] |= 1u << T::kind;
+	}
+
+public:
+	ContactHandler handler[OBJECT_TYPE_COUNT][OBJECT_TYPE_COUNT];	// [self][other], null if nothing happens
+	unsigned int mask[OBJECT_TYPE_COUNT];	// bit k: a handler exists with kind k, either way round
+
+	InteractionTable()
+	{
+		memset(handler, 0, sizeof(handler));
+		memset(mask, 0, sizeof(mask));
+		int expand[] = { 0, (Register<Types>(), 0)... };
+		(void)expand;
+	}
+
+	bool Interacts(int a, int b) { return (mask[a] >> b & 1) != 0; }
+
+	void Dispatch(Object* a, Object* b)
+	{
+		OBJECT_TYPE ka = a->GetType(), kb = b->GetType();
+		if (ContactHandler h = handler[ka][kb]) h(a, b);
+		if (ContactHandler h = handler[kb][ka]) h(b, a);
+	}
+};
+
+InteractionTable<Lander, Diamond, Platform, Flipper, Pokeball, Skuntank> interactions;
+
+// the dispatch the table replaced, kept as the baseline for --bench-dispatch:
+// every object had a virtual Interact that checked the other's type and then
+// the distance. this one only counts what it would have done
+struct VirtualReactor
+{
+	int hits;
+	VirtualReactor() : hits(0) { }
+	virtual ~VirtualReactor() { }
+	virtual void Interact(Object*, Object*) { }
+};
+
+template <typename T>
+struct VirtualReactorFor : VirtualReactor
+{
+	void Interact(Object* self, Object* o)
+	{
+		if (o->GetType() == T::reactsTo && self->TooClose(o)) hits++;
+	}
+};
+
+// uniform grid broadphase: objects are bucketed by the cell they sit in and
+// only objects in the same or adjacent cells are reported as candidate pairs
+class SpatialHash
+{
+	float cellSize;
+	unsigned int mask;
+	int count;
+	std::vector<int> head;	// first entry of each bucket, -1 if empty
+	std::vector<int> next;	// next entry in the same bucket
+	std::vector<int> cellX, cellY;
+
+	unsigned int Bucket(int cx, int cy)
+	{
+		return ((unsigned int)cx * 73856093u ^ (unsigned int)cy * 19349663u) & mask;
+	}
+
+public:
+	SpatialHash(float cellSize) : cellSize(cellSize), mask(0), count(0) { }
+
+	void Build(const vec2* positions, int n)
+	{
+		unsigned int buckets = 16;
+		while (buckets < 2 * (unsigned int)n) buckets <<= 1;
+		mask = buckets - 1;
+		count = n;
+		head.assign(buckets, -1);
+		next.resize(n);
+		cellX.resize(n);
+		cellY.resize(n);
+
+		for (int i = 0; i < n; i++)
+		{
+			cellX[i] = (int)floor(positions[i].x / cellSize);
+			cellY[i] = (int)floor(positions[i].y / cellSize);
+			unsigned int b = Bucket(cellX[i], cellY[i]);
+			next[i] = head[b];
+			head[b] = i;
+		}
+	}
+
+	// calls pair(i, j) once for every i < j in the same or neighbouring cells
+	template <typename F>
+	int ForEachPair(F pair)
+	{
+		int pairs = 0;
+		for (int i = 0; i < count; i++)
+		{
+			for (int dy = -1; dy <= 1; dy++)
+			{
+				for (int dx = -1; dx <= 1; dx++)
+				{
+					int cx = cellX[i] + dx, cy = cellY[i] + dy;
+					for (int j = head[Bucket(cx, cy)]; j >= 0; j = next[j])
+					{
+						// buckets can be shared by distant cells, so check the cell too
+						if (j > i && cellX[j] == cx && cellY[j] == cy)
+						{
+							pair(i, j);
+							pairs++;
+						}
+					}
+				}
+			}
+		}
+		return pairs;
+	}
+
+	// calls near(j) for every entry in the cell of p or a neighbouring one
+	template <typename F>
+	void ForEachNear(vec2 p, F near)
+	{
+		int px = (int)floor(p.x / cellSize), py = (int)floor(p.y / cellSize);
+		for (int dy = -1; dy <= 1; dy++)
+		{
+			for (int dx = -1; dx <= 1; dx++)
+			{
+				int cx = px + dx, cy = py + dy;
+				for (int j = head[Bucket(cx, cy)]; j >= 0; j = next[j])
+					if (cellX[j] == cx && cellY[j] == cy) near(j);
+			}
+		}
+	}
+};
+
+boolean mouseClicked = false;
+double lastTime = 0;	// simulation time of the last pokeball throw
+
+// the simulation advances in fixed ticks
+double tickRate = 60;
+double simulationTime = 0;
+
+// how many of each are spawned at startup
+int fireballCount = 10;
+int diamondCount = 10;
+
+double Milliseconds(std::chrono::steady_clock::duration d)
+{
+	return std::chrono::duration<double, std::milli>(d).count();
+}
+
+// fixed-size log-linear histogram of durations in nanoseconds, in the style
+// of HdrHistogram: below 64 ns every value has its own bucket, above that
+// each power of two is split into 32 buckets, so every recorded value is
+// kept to within about 3% up to two minutes
+class LatencyHistogram
+{
+	enum { SUB_BITS = 6, SUB = 1 << SUB_BITS, HALF = SUB / 2, MAGNITUDES = 32, BUCKETS = SUB + MAGNITUDES * HALF };
+
+	const char* name;
+	unsigned int counts[BUCKETS];
+	long long count, min, max;
+
+	static int Index(long long ns)
+	{
+		if (ns < SUB) return (int)ns;
+		int shift = 0;
+		while ((ns >> shift) >= SUB) shift++;	// ns >> shift lands in [HALF, SUB)
+		int index = SUB + (shift - 1) * HALF + (int)((ns >> shift) - HALF);
+		return index < BUCKETS ? index : BUCKETS - 1;
+	}
+
+	// smallest value of a bucket, the bucket after it starts at Lowest(index + 1)
+	static long long Lowest(int index)
+	{
+		if (index < SUB) return index;
+		int shift = (index - SUB) / HALF + 1;
+		return (long long)(HALF + (index - SUB) % HALF) << shift;
+	}
+
+public:
+	LatencyHistogram(const char* name) : name(name), count(0), min(0), max(0)
+	{
+		memset(counts, 0, sizeof(counts));
+	}
+
+	void Record(double ms)
+	{
+		long long ns = (long long)(ms * 1e6 + 0.5);
+		if (ns < 0) ns = 0;
+		counts[Index(ns)]++;
+		if (count == 0 || ns < min) min = ns;
+		if (ns > max) max = ns;
+		count++;
+	}
+
+	// in ms, the middle of the bucket holding the value below which percent of
+	// the samples fall, clamped to the exact extremes
+	double Percentile(double percent)
+	{
+		if (count == 0) return 0;
+		long long rank = (long long)ceil(percent / 100 * count), seen = 0;
+		if (rank < 1) rank = 1;
+		for (int i = 0; i < BUCKETS; i++)
+		{
+			seen += counts[i];
+			if (seen < rank) continue;
+			double ns = (Lowest(i) + Lowest(i + 1) - 1) / 2.0;
+			if (ns < min) ns = (double)min;
+			if (ns > max) ns = (double)max;
+			return ns / 1e6;
+		}
+		return max / 1e6;
+	}
+
+	void Print()
+	{
+		if (count == 0) return;
+		printf("%-6s %8lld samples  min %7.3f  p50 %7.3f  p90 %7.3f  p99 %7.3f  p99.9 %7.3f  max %7.3f ms\n",
+			name, count, min / 1e6, Percentile(50), Percentile(90), Percentile(99), Percentile(99.9), max / 1e6);
+	}
+
+	// one row per non-empty bucket
+	void WriteCsv(FILE* file)
+	{
+		for (int i = 0; i < BUCKETS; i++)
+			if (counts[i]) fprintf(file, "%s,%.6f,%.6f,%u\n", name, Lowest(i) / 1e6, Lowest(i + 1) / 1e6, counts[i]);
+	}
+};
+
+LatencyHistogram frameTimes("frame");	// between displayed frames, or one tick and draw when headless
+LatencyHistogram tickTimes("tick");
+const char* csvPath = 0;	// --csv
+
+void ReportLatencies()
+{
+	frameTimes.Print();
+	tickTimes.Print();
+	if (!csvPath) return;
+
+	FILE* file = fopen(csvPath, "w");
+	if (!file)
+	{
+		printf("cannot write %s\n", csvPath);
+		return;
+	}
+	fprintf(file, "series,from_ms,to_ms,count\n");
+	frameTimes.WriteCsv(file);
+	tickTimes.WriteCsv(file);
+	fclose(file);
+}
+
+// set by SIGINT, the main loops report and stop when they see it
+volatile sig_atomic_t interrupted = 0;
+
+void OnInterrupt(int)
+{
+	interrupted = 1;
+}
+
+int uploadBudget = 4 << 20;	// bytes of streamed textures handed to GL per frame
+const int uploadsInFlight = 2;	// streams holding an upload buffer at once
+
+// hands out one Texture per image path however often it is asked for.
+// Preload decodes a set of images on the thread pool and packs them into the
+// atlas, anything else is loaded on its own the first time it is acquired and
+// deleted with its last reference. atlas regions live as long as the manager.
+//
+// AcquireAsync returns at once with a texture that shows a placeholder. the
+// streaming thread decodes the image and copies it into a mapped upload
+// buffer, and Pump, called once a frame, starts and finishes uploads. mapping
+// a buffer and uploading from it both count against uploadBudget, and only
+// uploadsInFlight buffers are in use at a time
+class TextureManager
+{
+	struct Entry
+	{
+		std::string path;
+		Texture* texture;
+		int references;
+		bool owned;
+	};
+
+	enum { STREAM_DECODING, STREAM_DECODED, STREAM_FILLING, STREAM_FILLED };
+	struct Stream
+	{
+		Texture* texture;	// NULL once released before it arrived
+		DecodedImage image;
+		int width, height;
+		unsigned int buffer;
+		unsigned char* memory;
+		std::atomic<int> state;
+	};
+
+	TextureAtlas atlas;
+	std::vector<Entry> entries;
+	std::vector<Stream*> streams;
+	unsigned int placeholder;
+	// streaming stats, reported when the last pending texture arrives
+	int streamed, streamFrames;
+	long long streamedBytes;
+	double slowestPumpMs;
+	std::chrono::steady_clock::time_point streamStart;
+	ThreadPool streamer;	// last, so it is joined before the streams go
+
+	int Find(const std::string& path)
+	{
+		for (int i = 0; i < entries.size(); i++)
+			if (entries[i].path == path) return i;
+		return -1;
+	}
+
+	void Finish(int i)
+	{
+		streams[i]->image.Free();
+		delete streams[i];
+		streams.erase(streams.begin() + i);
+	}
+
+public:
+	TextureManager() : placeholder(0), streamed(0), streamFrames(0), streamedBytes(0), slowestPumpMs(0) { }
+
+	void Preload(const char* const* paths, int count)
+	{
+		PROFILE_SCOPE("TextureManager::Preload");
+		std::vector<DecodedImage> images;
+		for (int i = 0; i < count; i++)
+		{
+			if (Find(paths[i]) >= 0) continue;
+			bool listed = false;
+			for (int j = 0; j < images.size(); j++) listed |= images[j].path == paths[i];
+			if (listed) continue;
+			DecodedImage image = { paths[i], NULL, 0, 0, NULL, NULL };
+			images.push_back(image);
+		}
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		textureCacheHits = 0;
+		imageArenaStats.allocations = 0;
+		imageArenaStats.systemAllocations = 0;
+		imageArenaStats.peak = (long long)imageArenaStats.live;
+		DecodeImages(images);
+		std::chrono::steady_clock::time_point decoded = std::chrono::steady_clock::now();
+		atlas.Build(images);
+		std::chrono::steady_clock::time_point uploaded = std::chrono::steady_clock::now();
+
+		for (int i = 0; i < images.size(); i++)
+		{
+			Entry entry = { images[i].path, atlas.Get(images[i].path), 0, false };
+			entries.push_back(entry);
+		}
+		printf("textures: %d images (%d from cache) loaded in %.1f ms on %d threads, packed and uploaded in %.1f ms\n",
+			(int)images.size(), (int)textureCacheHits, Milliseconds(decoded - start), threadPool.Threads(), Milliseconds(uploaded - decoded));
+		printf("image arenas: %d stb_image allocations, %d from malloc, %.1f MB at peak\n",
+			(int)imageArenaStats.allocations, (int)imageArenaStats.systemAllocations, imageArenaStats.peak / 1048576.0);
+		if (streams.empty()) imageArenas.Trim();
+	}
+
+	Texture* Acquire(const std::string& path)
+	{
+		int i = Find(path);
+		if (i < 0)
+		{
+			Entry entry = { path, new Texture(path), 0, true };
+			entries.push_back(entry);
+			i = (int)entries.size() - 1;
+		}
+		entries[i].references++;
+		return entries[i].texture;
+	}
+
+	Texture* AcquireAsync(const std::string& path)
+	{
+		int i = Find(path);
+		if (i >= 0)
+		{
+			entries[i].references++;
+			return entries[i].texture;
+		}
+
+		if (!placeholder)
+		{
+			const unsigned char faint[4] = { 255, 255, 255, 64 };
+			placeholder = renderer->CreateTexture(1, 1, faint);
+		}
+		if (streams.empty())
+		{
+			streamStart = std::chrono::steady_clock::now();
+			streamFrames = 0;
+		}
+		if (!streamer.Running()) streamer.Start(1);
+
+		Texture* texture = new Texture(placeholder, 0, 0, 1, 1);
+		Entry entry = { path, texture, 1, true };
+		entries.push_back(entry);
+
+		Stream* stream = new Stream();
+		stream->texture = texture;
+		stream->image.path = path;
+		stream->image.data = NULL;
+		stream->image.cached = NULL;
+		stream->image.arena = NULL;
+		stream->state = STREAM_DECODING;
+		streams.push_back(stream);
+		streamer.Submit([stream] {
+			ReadImage(stream->image);
+			stream->state = STREAM_DECODED;
+		});
+		return texture;
+	}
+
+	// moves streamed textures along, never blocking on the streaming thread
+	void Pump()
+	{
+		if (streams.empty()) return;
+		PROFILE_SCOPE("TextureManager::Pump");
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		// the first piece of work in a frame always goes ahead, or a texture
+		// over budget would never arrive
+		int budget = uploadBudget;
+		int busy = 0;
+		for (int i = 0; i < streams.size(); i++)
+		{
+			int state = streams[i]->state;
+			if (state == STREAM_FILLING || state == STREAM_FILLED) busy++;
+		}
+		for (int i = 0; i < streams.size(); i++)
+		{
+			Stream* stream = streams[i];
+			int state = stream->state;
+			if (state == STREAM_DECODED)
+			{
+				if (!stream->texture || !stream->image.data)
+				{
+					if (stream->texture) printf("cannot load %s\n", stream->image.path.c_str());
+					Finish(i--);
+					continue;
+				}
+				int bytes = stream->image.width * stream->image.height * 4;
+				if (busy >= uploadsInFlight || (bytes > budget && budget < uploadBudget)) continue;
+				budget -= bytes;
+				stream->width = stream->image.width;
+				stream->height = stream->image.height;
+				stream->memory = renderer->BeginUpload(bytes, stream->buffer);
+				if (!stream->memory)
+				{
+					stream->texture->Assign(renderer->CreateTexture(stream->width, stream->height, stream->image.data));
+					Finish(i--);
+					continue;
+				}
+				busy++;
+				stream->state = STREAM_FILLING;
+				streamer.Submit([stream] {
+					memcpy(stream->memory, stream->image.data, stream->width * stream->height * 4);
+					stream->image.Free();
+					stream->state = STREAM_FILLED;
+				});
+			}
+			else if (state == STREAM_FILLED)
+			{
+				int bytes = stream->width * stream->height * 4;
+				if (bytes > budget && budget < uploadBudget) continue;
+				budget -= bytes;
+				unsigned int texture = renderer->FinishUpload(stream->buffer, stream->memory, stream->width, stream->height);
+				if (stream->texture && texture) stream->texture->Assign(texture);
+				else if (texture) renderer->DeleteTexture(texture);
+				streamed++;
+				streamedBytes += bytes;
+				busy--;
+				Finish(i--);
+			}
 		}
-	}
-};
 
-class Fireball : public TexturedQuad
-{
+		streamFrames++;
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		double pumpMs = Milliseconds(end - start);
+		if (pumpMs > slowestPumpMs) slowestPumpMs = pumpMs;
+		if (streams.empty())
+		{
+			imageArenas.Trim();
+			printf("streaming: %d textures, %.1f MB, arrived after %.1f ms over %d frames, at most %.2f ms of a frame\n",
+				streamed, streamedBytes / 1048576.0, Milliseconds(end - streamStart), streamFrames, slowestPumpMs);
+			streamed = 0;
+			streamedBytes = 0;
+			slowestPumpMs = 0;
+		}
+	}
 
-public:
-	Fireball(Texture* t) : TexturedQuad(t)
+	void Release(Texture* texture)
 	{
-		scale = vec2(0.1, 0.1);
-		velocity = vec2::random();
-		//orientation = atan(velocity.y / velocity.x);
-		position = vec2::random();
+		for (int i = 0; i < entries.size(); i++)
+		{
+			if (entries[i].texture != texture) continue;
+			if (--entries[i].references == 0 && entries[i].owned)
+			{
+				for (int j = 0; j < streams.size(); j++)
+					if (streams[j]->texture == texture) streams[j]->texture = NULL;
+				delete texture;
+				entries.erase(entries.begin() + i);
+			}
+			return;
+		}
 	}
 
-	OBJECT_TYPE GetType() { return FIREBALL; }
+	// needs the context, so it runs from onExit rather than the destructor
+	void Shutdown()
+	{
+		// whatever is still in flight is dropped, the mapped buffers go with the backend
+		streamer.Wait();
+		for (int i = 0; i < streams.size(); i++)
+		{
+			streams[i]->image.Free();
+			delete streams[i];
+		}
+		streams.clear();
+		for (int i = 0; i < entries.size(); i++)
+			if (entries[i].owned) delete entries[i].texture;
+		entries.clear();
+		atlas.Clear();
+		if (placeholder) renderer->DeleteTexture(placeholder);
+		placeholder = 0;
+	}
 
-	virtual void Move(float dt)
+	~TextureManager()
 	{
-		Object::Move(dt);
-		if (position.x < -2) position.x = 2;
-		if (position.x >  2) position.x = -2;
-		if (position.y < -2) position.y = 2;
-		if (position.y >  2) position.y = -2;
+		Shutdown();
 	}
 };
 
-class Platform : public TexturedQuad
+TextureManager textureManager;
+
+class Scene
 {
+	std::vector<Texture*> textures;	// acquired from textureManager
+	std::vector<Object*> objects;
+	std::vector<Object*> controlled;	// the kinematic ones, steered every tick
+	std::vector<vec2> positions;
+	SpatialHash broadphase;
+	// objects that interact with anything, grouped by kind, each with a grid
+	std::vector<int> members[OBJECT_TYPE_COUNT];
+	std::vector<vec2> memberPositions[OBJECT_TYPE_COUNT];
+	std::vector<SpatialHash> layers;
+	SpriteBatch batch;
+	Handle lander;
+	Platform* platform;
+	int livesShown;
 
-public:
-	Platform(Texture* t) : TexturedQuad(t)
+	void Add(Object* o)
 	{
-		scale = vec2(0.5, 0.1);
-		position = vec2(0.5, -0.9);
+		objects.push_back(o);
+		if (kindInfo[o->GetType()].motion == MOTION_KINEMATIC) controlled.push_back(o);
 	}
 
-	OBJECT_TYPE GetType() { return PLATFORM; }
+public:
+	enum { INTERACT, CONTROL, MOVE, COLLECT, PHASES };
+	double phaseMs[PHASES];	// of the last tick
+	int pairs;				// candidate pairs dispatched in the last tick
 
-	void Interact(Object* o)
+	Scene() : broadphase(interactionRadius), layers(OBJECT_TYPE_COUNT, SpatialHash(interactionRadius)), livesShown(0), pairs(0)
 	{
-		if (o->GetType() == LANDER)
-		{
-			if (TooClose(o))
-			{
-				if (o->Velocity().y > -0.5) landed = true;
-				else o->Destroy();
-			}
-		}
+		for (int i = 0; i < PHASES; i++) phaseMs[i] = 0;
 	}
-};
-
-class PlatformEnd : public TexturedQuad
-{
 
-public:
-	PlatformEnd(Texture* t, vec2 posn, vec2 platformscale, int side) : TexturedQuad(t)
+	void Initialize()
 	{
-		scale = vec2(0.1, platformscale.y);
-		if (side == 1) { 
-			position = vec2(posn.x + .3, posn.y);
-			scale = vec2(-0.1, platformscale.y);
-		}
-		else position = vec2(posn.x - .3, posn.y);
+		PROFILE_SCOPE("Scene::Initialize");
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		// the first eight are the ones the scene uses, indexed below
+		static const char* sprites[] = { "platform.png", "lander.png", "fireball.png",
+			"diamond.png", "afterburner.png", "platformend.png", "pokeball.png", "skun.png",
+			"boom.png" };
+		textureManager.Preload(sprites, 8);
+		for (int i = 0; i < 8; i++) textures.push_back(textureManager.Acquire(sprites[i]));
+		// only needed on the first hit, so it streams in behind the first frames
+		textures.push_back(textureManager.AcquireAsync(sprites[8]));
+		
+		Add(platform = new Platform(textures[0]));
+		Add(new Flipper(textures[0]));
+		Add(new PlatformEnd(textures[5], platform->GetPosition(), 
+			platform->Scale(), 1));
+		Add(new PlatformEnd(textures[5], platform->GetPosition(),
+			platform->Scale(), -1));
+		Lander* player = new Lander(textures[1]);
+		lander = player->GetHandle();
+		Add(player);
+		Add(new Skuntank(textures[7]));
+		Add(new Afterburner(textures[4]));
 		
+
+		for (int i = 0; i < fireballCount; i++) Add(new Fireball(textures[2]));
+		for (int i = 0; i < diamondCount; i++) Add(new Diamond(textures[3]));
+
+		for (int i = 1; i <= lives; i++) {
+			Life* life = new Life(textures[1], i);
+			Add(life);
+		}
+		livesShown = lives;
+
+		// nothing to interpolate from before the first tick
+		entities.SavePrevious();
+		printf("startup: scene initialized in %.1f ms\n", Milliseconds(std::chrono::steady_clock::now() - start));
 	}
 
-	OBJECT_TYPE GetType() { return PLATFORM; }
-};
+	// deletes the objects and with them their meshes. onExit calls this while
+	// the GL context is still current, which leaves nothing for the destructor
+	void Clear()
+	{
+		Collect();
+		for (int i = 0; i < objects.size(); i++) delete objects[i];
+		objects.clear();
+		controlled.clear();
+		for (int i = 0; i < textures.size(); i++) textureManager.Release(textures[i]);
+		textures.clear();
+	}
 
-class Flipper : public TexturedQuad
-{
-public:
-	Flipper(Texture* t) : TexturedQuad(t)
+	~Scene()
 	{
-		scale = vec2(0.5, 0.1);
-		position = vec2(-0.5, -0.7);
+		Clear();
 	}
 
-	OBJECT_TYPE GetType() { return PLATFORM; }
+	int ObjectCount() { return (int)objects.size(); }
 
-	void Interact(Object* o)
+	void Draw()
 	{
-		if (o->GetType() == LANDER)
+		PROFILE_SCOPE("Scene::Draw");
+		textureManager.Pump();
+		entities.BuildTransforms(renderAlpha);
+		if (!renderer->Instancing())
 		{
-			if (TooClose(o))
-			{
-				vec2 old = o->velocity;
-				o->velocity = vec2(old.x, old.y * -1);
-			}
+			for (int i = 0; i < objects.size(); i++) objects[i]->Draw();
+			return;
 		}
+		for (int i = 0; i < objects.size(); i++) objects[i]->Submit(batch);
+		batch.Flush();
 	}
-};
 
-boolean caught = false;
+	void Move(float dt)
+	{
+		PROFILE_SCOPE("Scene::Move");
+		entities.Move(dt);
+	}
 
-class Pokeball : public TexturedQuad
-{
-public:
-	Pokeball(Texture* t, vec2 posn) : TexturedQuad(t)
+	void Control(float dt)
 	{
-		scale = vec2(0.1, 0.1);
-		position = posn;
-		
-		float mx = ((mouseX - (windowWidth/2))/1000) *2;
-		float my = -((mouseY - (windowHeight/2))/1000) *2;
+		PROFILE_SCOPE("Scene::Control");
+		for (int i = 0; i < controlled.size(); i++) controlled[i]->Control(dt);
 
-		vec2 click = vec2(mx, my);
-		
-		float distance = sqrt(pow(click.x - posn.x, 2) + pow(click.y - posn.y, 2));
-		float directionX = (click.x - posn.x) / distance;
-		float directionY = (click.y - posn.y) / distance;
+		// the life icons only change when a life is lost
+		if (lives != livesShown)
+		{
+			int lifecounter = 0;
+			for (int i = 0; i < objects.size(); i++)
+			{
+				if (objects[i]->StillAlive() && objects[i]->GetType() == LIFE) {
+					if (lifecounter < lives) lifecounter += 1;
+					else objects[i]->Destroy();
+				}
+			}
+			livesShown = lives;
+		}
+
+		if (newDiamond) {
+			Add(new DiamondCount(textures[3], diamonds));
+			newDiamond = false;
+		};
+		if (hit) {
+			Add(new Boom(textures[8], hitPosition));
+			hit = false;
+		}
+		Object* player = handles.Get(lander);
+		if (mouseClicked && !caught && player) {
+			if (simulationTime - lastTime > 1.0) {
+				Add(new Pokeball(textures[6], player->GetPosition()));
+				lastTime = simulationTime;
+			}
+		}
+		if (mouseClicked && caught && player) {
+			Add(new FlameThrower(textures[2], player->GetPosition()));
+		}
+	}
 
-		velocity = vec2(directionX, directionY);
+	// end of tick: close the gaps left in the object list by everything
+	// destroyed during the tick, then recycle it. The list keeps its order
+	// (it is the draw order on the per-object path); compaction starts at
+	// the first dead entry and costs nothing when nothing died.
+	void Collect()
+	{
+		PROFILE_SCOPE("Scene::Collect");
+		if (entities.destroyed.empty()) return;
+
+		int count = (int)objects.size();
+		int first = 0;
+		while (first < count && objects[first]->StillAlive()) first++;
+		int kept = first;
+		for (int i = first; i < count; i++)
+			if (objects[i]->StillAlive()) objects[kept++] = objects[i];
+		objects.resize(kept);
+
+		kept = 0;
+		for (int i = 0; i < controlled.size(); i++)
+			if (controlled[i]->StillAlive()) controlled[kept++] = controlled[i];
+		controlled.resize(kept);
+
+		for (int i = 0; i < entities.destroyed.size(); i++) delete entities.destroyed[i];
+		entities.destroyed.clear();
 	}
 
-	OBJECT_TYPE GetType() { return POKEBALL; }
+	// returns whether the tick changed anything on screen: something moved,
+	// was spawned or was destroyed
+	bool Tick(float dt)
+	{
+		PROFILE_SCOPE("Scene::Tick");
+		int objectsBefore = (int)objects.size();
+		std::chrono::steady_clock::time_point t[PHASES + 1];
+		t[0] = std::chrono::steady_clock::now();
+		Interact();
+		t[1] = std::chrono::steady_clock::now();
+		Control(dt);
+		t[2] = std::chrono::steady_clock::now();
+		Move(dt);
+		t[3] = std::chrono::steady_clock::now();
+		bool changed = !entities.destroyed.empty() || objects.size() != objectsBefore || entities.AnyMoved();
+		Collect();
+		t[4] = std::chrono::steady_clock::now();
+		for (int i = 0; i < PHASES; i++) phaseMs[i] = Milliseconds(t[i + 1] - t[i]);
+		tickTimes.Record(Milliseconds(t[PHASES] - t[0]));
+		return changed;
+	}
 
-	void Interact(Object* o)
+	// only kinds with a handler between them are tested against each other:
+	// for each such pair the smaller group probes a grid over the larger one
+	void Interact()
 	{
-		if (o->GetType() == SKUNTANK)
+		PROFILE_SCOPE("Scene::Interact");
+		for (int k = 0; k < OBJECT_TYPE_COUNT; k++)
+		{
+			members[k].clear();
+			memberPositions[k].clear();
+		}
+		for (int i = 0; i < objects.size(); i++)
+		{
+			int k = objects[i]->GetType();
+			if (!interactions.mask[k]) continue;
+			members[k].push_back(i);
+			memberPositions[k].push_back(objects[i]->GetPosition());
+		}
+
+		unsigned int built = 0;
+		pairs = 0;
+		for (int a = 0; a < OBJECT_TYPE_COUNT; a++)
 		{
-			if (TooClose(o)) {
-				caught = true;
-				Destroy();
-			}			
+			for (int b = a; b < OBJECT_TYPE_COUNT; b++)
+			{
+				if (!interactions.Interacts(a, b) || members[a].empty() || members[b].empty()) continue;
+
+				int probe = members[a].size() <= members[b].size() ? a : b;
+				int grid = probe == a ? b : a;
+				if (!(built >> grid & 1))
+				{
+					layers[grid].Build(memberPositions[grid].data(), (int)memberPositions[grid].size());
+					built |= 1u << grid;
+				}
+				for (int p = 0; p < members[probe].size(); p++)
+				{
+					Object* o = objects[members[probe][p]];
+					layers[grid].ForEachNear(memberPositions[probe][p], [&](int q) {
+						if (a == b && q <= p) return;	// same kind: each pair once
+						interactions.Dispatch(o, objects[members[grid][q]]);
+						pairs++;
+					});
+				}
+			}
 		}
 	}
 
-	virtual void Move(float dt)
+	// times the collision step on the current scene: every candidate pair a
+	// grid over all objects reports, dispatched one by one, against Interact
+	void BenchmarkDispatch(int reps)
 	{
-		Object::Move(dt);
-		if (position.x < -1) Destroy();
-		if (position.x >  1) Destroy();
-		if (position.y < -1) Destroy();
-		if (position.y >  1) Destroy();
+		positions.resize(objects.size());
+		for (int i = 0; i < objects.size(); i++) positions[i] = objects[i]->GetPosition();
+		broadphase.Build(positions.data(), (int)positions.size());
+		std::vector<std::pair<int, int> > pairs;
+		broadphase.ForEachPair([&](int i, int j) { pairs.push_back(std::make_pair(i, j)); });
+
+		VirtualReactor inert;
+		VirtualReactorFor<Lander> lander;
+		VirtualReactorFor<Diamond> diamond;
+		VirtualReactorFor<Platform> platform;
+		VirtualReactorFor<Flipper> flipper;
+		VirtualReactorFor<Pokeball> pokeball;
+		VirtualReactorFor<Skuntank> skuntank;
+		VirtualReactor* byKind[OBJECT_TYPE_COUNT];
+		for (int k = 0; k < OBJECT_TYPE_COUNT; k++) byKind[k] = &inert;
+		byKind[Lander::kind] = &lander;
+		byKind[Diamond::kind] = &diamond;
+		byKind[Platform::kind] = &platform;
+		byKind[Flipper::kind] = &flipper;
+		byKind[Pokeball::kind] = &pokeball;
+		byKind[Skuntank::kind] = &skuntank;
+		std::vector<VirtualReactor*> reactors(objects.size());
+		for (int i = 0; i < objects.size(); i++) reactors[i] = byKind[objects[i]->GetType()];
+
+		// before the table, which acts on the contacts it finds
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < reps; r++)
+		{
+			for (int p = 0; p < pairs.size(); p++)
+			{
+				int i = pairs[p].first, j = pairs[p].second;
+				reactors[i]->Interact(objects[i], objects[j]);
+				reactors[j]->Interact(objects[j], objects[i]);
+			}
+		}
+		double virtualDispatch = Milliseconds(std::chrono::steady_clock::now() - start);
+
+		start = std::chrono::steady_clock::now();
+		for (int r = 0; r < reps; r++)
+			for (int p = 0; p < pairs.size(); p++)
+				interactions.Dispatch(objects[pairs[p].first], objects[pairs[p].second]);
+		double dispatch = Milliseconds(std::chrono::steady_clock::now() - start);
+
+		start = std::chrono::steady_clock::now();
+		for (int r = 0; r < reps; r++) Interact();
+		double interact = Milliseconds(std::chrono::steady_clock::now() - start);
+
+		printf("%d objects, %d candidate pairs\n", (int)objects.size(), (int)pairs.size());
+		double perPair = pairs.empty() ? 0.0 : 1e6 / ((double)reps * pairs.size());
+		printf("virtual dispatch %.2f ns per pair, table dispatch %.2f ns per pair\n", virtualDispatch * perPair, dispatch * perPair);
+		printf("per tick: virtual dispatch over every pair %.3f ms, layered interact %.3f ms\n", virtualDispatch / reps, interact / reps);
 	}
 };
 
-class FlameThrower : public TexturedQuad
-{
-public:
-	FlameThrower(Texture* t, vec2 posn) : TexturedQuad(t)
-	{
-		scale = vec2(0.1, 0.1);
-		position = posn;
+Scene scene;
 
-		float mx = ((mouseX - (windowWidth / 2)) / 1000) * 2;
-		float my = -((mouseY - (windowHeight / 2)) / 1000) * 2;
+// turns vertical sync on (1) or off (0) where the platform lets us
+void SetSwapInterval(int interval)
+{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+	typedef BOOL(WINAPI *SwapIntervalProc)(int);
+	SwapIntervalProc swapInterval = (SwapIntervalProc)wglGetProcAddress("wglSwapIntervalEXT");
+	if (swapInterval) swapInterval(interval);
+#elif !defined(__APPLE__)
+	typedef int(*SwapIntervalProc)(int);
+	SwapIntervalProc swapInterval = (SwapIntervalProc)glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalMESA");
+	if (!swapInterval) swapInterval = (SwapIntervalProc)glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalSGI");
+	if (swapInterval) swapInterval(interval);
+#endif
+}
 
-		vec2 click = vec2(mx, my);
+// owns the decision of when a frame is drawn and measures what each frame
+// cost on the CPU (issuing the draw) and on the GPU (timer queries)
+class FramePacer
+{
+	typedef std::chrono::steady_clock Clock;
 
-		float distance = sqrt(pow(click.x - posn.x, 2) + pow(click.y - posn.y, 2));
-		float directionX = (click.x - posn.x) / distance;
-		float directionY = (click.y - posn.y) / distance;
+	Clock::time_point nextFrame, frameStart, reportStart;
+	bool dirty;
+	bool timerQueries;
+	unsigned int queries[2];
+	int frame;
+	double cpuSum, gpuSum;
+	int reportFrames, gpuSamples;
 
-		velocity = vec2(directionX, directionY);
+public:
+	double targetFps;	// 0 draws as often as possible
+	int vsync;			// 1 forces it on, 0 off, -1 leaves the driver setting alone
+	bool lazy;			// draw only when something changed
+	bool report;		// print a summary every second
+	double lastCpuMs, lastGpuMs;
+
+	FramePacer() : dirty(true), timerQueries(false), frame(0), cpuSum(0), gpuSum(0),
+		reportFrames(0), gpuSamples(0), targetFps(0), vsync(-1), lazy(false), report(false),
+		lastCpuMs(0), lastGpuMs(0) { }
+
+	// timer queries need GL 3.3
+	void Initialize(bool timerQueriesSupported)
+	{
+		timerQueries = timerQueriesSupported;
+		if (timerQueries) glGenQueries(2, queries);
+		if (vsync >= 0) SetSwapInterval(vsync);
+		nextFrame = reportStart = Clock::now();
 	}
 
-	OBJECT_TYPE GetType() { return FLAMETHROWER; }
+	void Invalidate() { dirty = true; }
 
-	virtual void Move(float dt)
+	bool FrameDue()
 	{
-		Object::Move(dt);
-		if (position.x < -1) Destroy();
-		if (position.x >  1) Destroy();
-		if (position.y < -1) Destroy();
-		if (position.y >  1) Destroy();
+		if (lazy && !dirty) return false;
+		return targetFps <= 0 || Clock::now() >= nextFrame;
 	}
-};
 
-class Skuntank : public TexturedQuad
-{
-public:
-	Skuntank(Texture* t) : TexturedQuad(t)
+	double SecondsUntilDue()
 	{
-		scale = vec2(0.3, 0.3);
-		position = vec2(-0.3, -0.6);
+		if (targetFps <= 0) return 0;
+		double wait = std::chrono::duration<double>(nextFrame - Clock::now()).count();
+		return wait > 0 ? wait : 0;
 	}
 
-	OBJECT_TYPE GetType() { return SKUNTANK; }
+	void BeginFrame()
+	{
+		frameStart = Clock::now();
+		if (timerQueries) glBeginQuery(GL_TIME_ELAPSED, queries[frame & 1]);
+	}
 
-	void Interact(Object* o)
+	// call before the buffer swap, which may block on vsync
+	void EndDraw()
 	{
-		if (o->GetType() == POKEBALL)
+		lastCpuMs = Milliseconds(Clock::now() - frameStart);
+		if (!timerQueries) return;
+
+		glEndQuery(GL_TIME_ELAPSED);
+		// read the previous frame's query so we never wait for the GPU
+		if (frame > 0)
 		{
-			if (TooClose(o)) {
-				Destroy();
+			int available = 0;
+			unsigned int previous = queries[(frame - 1) & 1];
+			glGetQueryObjectiv(previous, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available)
+			{
+				GLuint64 nanoseconds;
+				glGetQueryObjectui64v(previous, GL_QUERY_RESULT, &nanoseconds);
+				lastGpuMs = nanoseconds * 1e-6;
+				gpuSum += lastGpuMs;
+				gpuSamples++;
 			}
 		}
 	}
 
+	void EndFrame()
+	{
+		frame++;
+		dirty = false;
+		if (targetFps > 0)
+		{
+			Clock::time_point now = Clock::now();
+			nextFrame += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / targetFps));
+			if (nextFrame < now) nextFrame = now;
+		}
+
+		cpuSum += lastCpuMs;
+		reportFrames++;
+		double elapsed = std::chrono::duration<double>(Clock::now() - reportStart).count();
+		if (report && elapsed >= 1.0)
+		{
+			printf("%.0f fps, %.2f ms cpu", reportFrames / elapsed, cpuSum / reportFrames);
+			if (gpuSamples > 0) printf(", %.2f ms gpu", gpuSum / gpuSamples);
+			printf(" per frame, last frame %d GL state calls issued, %d skipped\n", glState.lastIssued, glState.lastSkipped);
+			cpuSum = gpuSum = 0;
+			reportFrames = gpuSamples = 0;
+			reportStart = Clock::now();
+		}
+	}
 };
 
-boolean mouseClicked = false;
-int lastTime = 0;
+FramePacer pacer;
 
-class Scene
+// performance panel in the bottom left corner, toggled with 'o'. Rows from
+// the top: frame, GPU and draw call numbers; the last 120 frame times (the
+// grey line is 16.7 ms); the last tick's interact, control, move and collect
+// times stacked (full width is 2 ms) with their total; entity and collision
+// pair counts. Everything is one vertex buffer drawn in one call, after the
+// frame's own numbers have been taken.
+class Overlay
 {
-	std::vector<Texture*> textures;
-	std::vector<Object*> objects;
-	Lander* lander;
-	Platform* platform;
+	enum { HISTORY = 120 };
 
-public:
-	Scene()
+	std::vector<ColoredVertex> vertices;
+	float frameMs[HISTORY];
+	int next;
+
+	void Rect(float x, float y, float w, float h, const float* color)
 	{
-		lander = 0;
+		float corners[6][2] = { { x, y }, { x + w, y }, { x + w, y + h }, { x, y }, { x + w, y + h }, { x, y + h } };
+		for (int i = 0; i < 6; i++)
+		{
+			ColoredVertex v = { corners[i][0], corners[i][1], color[0], color[1], color[2] };
+			vertices.push_back(v);
+		}
 	}
 
-	void Initialize()
+	// seven-segment digits, returns the x after the text
+	float Text(const char* text, float x, float y, float h, const float* color)
 	{
-		textures.push_back(new Texture("platform.png"));
-		textures.push_back(new Texture("lander.png"));
-		textures.push_back(new Texture("fireball.png"));
-		textures.push_back(new Texture("diamond.png"));
-		textures.push_back(new Texture("afterburner.png"));
-		textures.push_back(new Texture("platformend.png"));
-		textures.push_back(new Texture("pokeball.png"));
-		textures.push_back(new Texture("skun.png"));
-		
-		objects.push_back(platform = new Platform(textures[0]));
-		objects.push_back(new Flipper(textures[0]));
-		objects.push_back(new PlatformEnd(textures[5], platform->GetPosition(), 
-			platform->Scale(), 1));
-		objects.push_back(new PlatformEnd(textures[5], platform->GetPosition(),
-			platform->Scale(), -1));
-		lander = new Lander(textures[1]);
-		objects.push_back(lander);
-		objects.push_back(new Skuntank(textures[7]));
-		objects.push_back(new Afterburner(textures[4]));
-		
-
-		for (int i = 0; i < 10; i++) objects.push_back(new Fireball(textures[2]));
-		for (int i = 0; i < 10; i++) objects.push_back(new Diamond(textures[3]));
-
-		for (int i = 1; i <= lives; i++) {
-			Life* life = new Life(textures[1], i);
-			objects.push_back(life);
+		// segments a to g as bits 0 to 6
+		static const unsigned char digits[] = { 0x3f, 0x06, 0x5b, 0x4f, 0x66, 0x6d, 0x7d, 0x07, 0x7f, 0x6f };
+		float w = h * 0.55f, t = h * 0.12f, half = h / 2;
+		for (const char* c = text; *c; c++)
+		{
+			if (*c == '.')
+			{
+				Rect(x, y, t, t, color);
+				x += 2 * t;
+				continue;
+			}
+			unsigned char segments = *c == '-' ? 0x40 : (*c >= '0' && *c <= '9' ? digits[*c - '0'] : 0);
+			if (segments & 0x01) Rect(x, y + h - t, w, t, color);
+			if (segments & 0x02) Rect(x + w - t, y + half, t, half, color);
+			if (segments & 0x04) Rect(x + w - t, y, t, half, color);
+			if (segments & 0x08) Rect(x, y, w, t, color);
+			if (segments & 0x10) Rect(x, y, t, half, color);
+			if (segments & 0x20) Rect(x, y + half, t, half, color);
+			if (segments & 0x40) Rect(x, y + half - t / 2, w, t, color);
+			x += w + 2 * t;
 		}
+		return x;
 	}
 
-	~Scene()
+	float Number(double value, int decimals, float x, float y, float h, const float* color)
 	{
-		for (int i = 0; i < textures.size(); i++) delete textures[i];
-		for (int i = 0; i < objects.size(); i++) delete objects[i];
+		char text[32];
+		snprintf(text, sizeof(text), "%.*f", decimals, value);
+		return Text(text, x, y, h, color);
 	}
 
-	void Draw()
+public:
+	bool visible;
+
+	Overlay() : next(0), visible(false)
 	{
-		for (int i = 0; i < objects.size(); i++) objects[i]->Draw();
+		for (int i = 0; i < HISTORY; i++) frameMs[i] = 0;
 	}
 
-	void Move(float dt)
+	// once per displayed frame, drawCalls being the ones the frame made
+	void Frame(double ms, int drawCalls, double gpuMs)
 	{
-		for (int i = 0; i < objects.size(); i++) objects[i]->Move(dt);
+		frameMs[next] = (float)ms;
+		next = (next + 1) % HISTORY;
+		if (!visible) return;
+
+		static const float background[] = { 0.1f, 0.1f, 0.1f }, white[] = { 1, 1, 1 }, cyan[] = { 0.3f, 0.9f, 1 },
+			green[] = { 0.3f, 1, 0.3f }, yellow[] = { 1, 0.85f, 0.2f }, red[] = { 1, 0.3f, 0.2f },
+			magenta[] = { 1, 0.4f, 1 }, grey[] = { 0.5f, 0.5f, 0.5f };
+		static const float* phaseColors[] = { red, cyan, green, yellow };
+
+		const float left = -0.98f, bottom = -0.98f, width = 0.9f;
+		vertices.clear();
+		Rect(left, bottom, width, 0.46f, background);
+
+		float x = left + 0.02f;
+		Number(frameMs[(next + HISTORY - 1) % HISTORY], 2, x, -0.62f, 0.06f, white);
+		Number(gpuMs, 2, x + 0.3f, -0.62f, 0.06f, cyan);
+		Number(drawCalls, 0, x + 0.6f, -0.62f, 0.06f, green);
+
+		float barWidth = (width - 0.04f) / HISTORY, graphBottom = -0.76f, graphHeight = 0.12f;
+		for (int i = 0; i < HISTORY; i++)
+		{
+			float ms = frameMs[(next + i) % HISTORY];
+			float h = ms / 33.3f * graphHeight;
+			if (h > graphHeight) h = graphHeight;
+			Rect(x + i * barWidth, graphBottom, barWidth * 0.8f, h, ms <= 16.7f ? green : ms <= 33.3f ? yellow : red);
+		}
+		Rect(x, graphBottom + graphHeight / 2, width - 0.04f, 0.003f, grey);
+
+		double tickMs = 0;
+		float phaseX = x;
+		for (int i = 0; i < Scene::PHASES; i++)
+		{
+			float w = (float)scene.phaseMs[i] * 0.3f;
+			if (phaseX + w > x + 0.6f) w = x + 0.6f - phaseX;
+			if (w > 0) Rect(phaseX, -0.84f, w, 0.05f, phaseColors[i]);
+			phaseX += w;
+			tickMs += scene.phaseMs[i];
+		}
+		Number(tickMs, 3, x + 0.64f, -0.84f, 0.05f, white);
+
+		Number(entities.Count(), 0, x, -0.95f, 0.06f, yellow);
+		Number(scene.pairs, 0, x + 0.3f, -0.95f, 0.06f, magenta);
+
+		renderer->DrawColored(vertices.data(), (int)vertices.size());
 	}
+};
 
-	void Control()
-	{
-		for (int i = 0; i < objects.size(); i++) objects[i]->Control();
+Overlay overlay;
 
-		std::vector<Object*> tmp = objects;
-		objects.clear();
-		int lifecounter = 0;
-		if (newDiamond) {
-			objects.push_back(new DiamondCount(textures[3], diamonds));
-			newDiamond = false;
-		};
-		if (mouseClicked && !caught) {
-			if (glutGet(GLUT_ELAPSED_TIME) - lastTime > 1000) {
-				objects.push_back(new Pokeball(textures[6], lander->GetPosition()));
-				lastTime = glutGet(GLUT_ELAPSED_TIME);
-			}
+// compares the all-pairs loop against the grid on random positions, spread
+// over the same [-2, 2] range the fireballs wrap around in
+void BenchmarkBroadphase()
+{
+	SpatialHash grid(interactionRadius);
+	int crossover = 0;
+
+	printf("%8s %16s %16s %8s\n", "objects", "all-pairs us", "grid us", "hits");
+	for (int n = 4; n <= 8192; n *= 2)
+	{
+		std::vector<vec2> p(n);
+		for (int i = 0; i < n; i++) p[i] = vec2::random() * 2;
+		int reps = 1 + (1 << 22) / (n * n);
+
+		int hits = 0, gridHits = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < reps; r++)
+			for (int i = 0; i < n; i++)
+				for (int j = 0; j < n; j++)
+					if (i < j && (p[i] - p[j]).length() < interactionRadius) hits++;
+		double allPairs = Milliseconds(std::chrono::steady_clock::now() - start) * 1000 / reps;
+
+		start = std::chrono::steady_clock::now();
+		for (int r = 0; r < reps; r++)
+		{
+			grid.Build(p.data(), n);
+			grid.ForEachPair([&](int i, int j) {
+				if ((p[i] - p[j]).length() < interactionRadius) gridHits++;
+			});
 		}
-		if (mouseClicked && caught) {
-			objects.push_back(new FlameThrower(textures[2], lander->GetPosition()));
+		double gridTime = Milliseconds(std::chrono::steady_clock::now() - start) * 1000 / reps;
+
+		if (hits != gridHits) printf("broadphase missed %d pairs\n", (hits - gridHits) / reps);
+		printf("%8d %16.2f %16.2f %8d\n", n, allPairs, gridTime, hits / reps);
+		if (!crossover && gridTime < allPairs) crossover = n;
+	}
+	if (crossover) printf("grid is faster from about %d objects\n", crossover);
+}
+
+// times each move kernel this CPU supports on batches of entities where half
+// wrap, a quarter cull and the rest do neither, after checking them against
+// the scalar kernel on a step that culls about half of the culling ones. The
+// timed runs keep culling entities in bounds, as the game deletes them.
+void BenchmarkKernels()
+{
+	int levels = SimdLevel();
+	printf("%10s", "entities");
+	for (int level = 0; level <= levels; level++) printf(" %12s", simdNames[level]);
+	printf("   ns per entity\n");
+
+	static const int sizes[] = { 1000, 100000, 1000000 };
+	for (int s = 0; s < 3; s++)
+	{
+		int n = sizes[s];
+		std::vector<vec2> start(n), timed(n), velocity(n), wrap(n), cull(n), position(n), reference(n);
+		std::vector<float> orientation(n), angularVelocity(n, 90);
+		for (int i = 0; i < n; i++)
+		{
+			start[i] = timed[i] = vec2::random() * 2;
+			velocity[i] = vec2::random();
+			float w = i % 2 == 0 ? 2 : FLT_MAX, c = i % 4 == 1 ? 1 : FLT_MAX;
+			wrap[i] = vec2(w, w);
+			cull[i] = vec2(c, c);
+			if (c < FLT_MAX) timed[i] = timed[i] * 0.25f;
 		}
-		for (int i = 0; i < tmp.size(); i++)
+		int reps = 1 + 20000000 / n;
+		std::vector<int> culled, referenceCulled;
+
+		printf("%10d", n);
+		for (int level = 0; level <= levels; level++)
 		{
-			if (tmp[i]->StillAlive())
+			MoveKernel kernel = MoveKernelFor(level);
+			position = start;
+			MoveBatch b = { &position[0].x, &velocity[0].x, &wrap[0].x, &cull[0].x,
+				orientation.data(), angularVelocity.data(), n };
+
+			culled.clear();
+			kernel(b, 1 / 60.0f, culled);
+			if (level == 0)
 			{
-				if (tmp[i]->GetType() == LIFE) {
-					if (lifecounter < lives) {
-						objects.push_back(tmp[i]);
-						lifecounter += 1;
-					}
-				}
-				else if (tmp[i]->GetType() == LANDER) {
-					objects.push_back(tmp[i]);
-				}
-				else objects.push_back(tmp[i]);
+				reference = position;
+				referenceCulled = culled;
+			}
+			else if (culled != referenceCulled || memcmp(&position[0], &reference[0], n * sizeof(vec2)) != 0)
+			{
+				printf("\n%s kernel disagrees with scalar\n", simdNames[level]);
 			}
+
+			// alternate directions so culling entities stay put
+			position = timed;
+			auto begin = std::chrono::steady_clock::now();
+			for (int r = 0; r < reps; r++)
+			{
+				culled.clear();
+				kernel(b, r % 2 ? -1 / 60.0f : 1 / 60.0f, culled);
+			}
+			double ms = Milliseconds(std::chrono::steady_clock::now() - begin);
+			printf(" %12.3f", ms * 1e6 / ((double)reps * n));
 		}
-		tmp.clear();
-		lifecounter = 0;
+		printf("\n");
 	}
+}
 
-	void Interact()
+void BenchmarkDispatch()
+{
+	renderer = &nullBackend;
+	scene.Initialize();
+	scene.BenchmarkDispatch(20);
+}
+
+// runs the simulation flat out without a window or GL context, drawing into
+// the null backend so the CPU side of rendering is still exercised
+void RunHeadless(int ticks)
+{
+	renderer = &nullBackend;
+	scene.Initialize();
+	int objectsAtStart = scene.ObjectCount();
+
+	double tick = 1.0 / tickRate;
+	std::chrono::steady_clock::duration simulation(0), drawing(0);
+	int ran = 0;
+	for (; ran < ticks && !interrupted; ran++)
 	{
-		for (int i = 0; i < objects.size(); i++)
-			for (int j = 0; j < objects.size(); j++)
-				objects[i]->Interact(objects[j]);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		scene.Tick(tick);
+		simulationTime += tick;
+		std::chrono::steady_clock::time_point simulated = std::chrono::steady_clock::now();
+		scene.Draw();
+		std::chrono::steady_clock::time_point drawn = std::chrono::steady_clock::now();
+		drawing += drawn - simulated;
+		simulation += simulated - start;
+		frameTimes.Record(Milliseconds(drawn - start));
 	}
-};
-
-Scene scene;
+	ticks = ran;
+
+	double total = Milliseconds(simulation + drawing);
+	printf("%d ticks, %d objects at start, %d at end, %d awake\n", ticks, objectsAtStart, scene.ObjectCount(), entities.awake);
+	printf("simulation %.1f ms, draw submission %.1f ms\n", Milliseconds(simulation), Milliseconds(drawing));
+	printf("%.0f ticks per second\n", total > 0 ? ticks * 1000.0 / total : 0.0);
+	ReportLatencies();
+	if (profiler.tracePath) profiler.Write(profiler.tracePath);
+}
 
 void onInitialization() {
+	PROFILE_SCOPE("onInitialization");
 	glViewport(0, 0, windowWidth, windowHeight);
-	// Create vertex shader from string
-	unsigned int vertexShader0 = glCreateShader(GL_VERTEX_SHADER); // vertex shader 0
-	if (!vertexShader0) { printf("Error in vertex shader 0 creation\n"); exit(1); }
-	glShaderSource(vertexShader0, 1, &vertexSource0, NULL);
-	glCompileShader(vertexShader0);
-	checkShader(vertexShader0, "Vertex shader 0 error");
-
-	unsigned int fragmentShader0 = glCreateShader(GL_FRAGMENT_SHADER); // pixel shader 0
-	if (!fragmentShader0) { printf("Error in fragment shader 0 creation\n"); exit(1); }
-	glShaderSource(fragmentShader0, 1, &fragmentSource0, NULL);
-	glCompileShader(fragmentShader0);
-	checkShader(fragmentShader0, "Fragment shader 0 error");
-
-	shaderProgram0 = glCreateProgram(); // shaderProgram0 is a global unsigned int 
-	if (!shaderProgram0) { printf("Error in shader program 0 creation\n"); exit(1); }
-	glAttachShader(shaderProgram0, vertexShader0);
-	glAttachShader(shaderProgram0, fragmentShader0);
-	glBindAttribLocation(shaderProgram0, 0, "vertexPosition");
-	glBindAttribLocation(shaderProgram0, 1, "vertexTexCoord");
-	glBindFragDataLocation(shaderProgram0, 0, "fragmentColor");
-	glLinkProgram(shaderProgram0);
-	checkLinking(shaderProgram0);
-
-
-	// vertexshader1
-	unsigned int vertexShader1 = glCreateShader(GL_VERTEX_SHADER); // vertex shader 1
-	if (!vertexShader1) { printf("Error in vertex shader 1 creation\n"); exit(1); }
-	glShaderSource(vertexShader1, 1, &vertexSource1, NULL);
-	glCompileShader(vertexShader1);
-	checkShader(vertexShader1, "Vertex shader error");
-
-	unsigned int fragmentShader1 = glCreateShader(GL_FRAGMENT_SHADER); // pixel shader 1
-	if (!fragmentShader1) { printf("Error in fragment shader 1 creation\n"); exit(1); }
-	glShaderSource(fragmentShader1, 1, &fragmentSource1, NULL);
-	glCompileShader(fragmentShader1);
-	checkShader(fragmentShader1, "Fragment shader 1 error");
-
-	shaderProgram1 = glCreateProgram(); // shaderProgram1 is a global unsigned int
-	if (!shaderProgram0) { printf("Error in shader program 1 creation\n"); exit(1); }
-	glAttachShader(shaderProgram1, vertexShader1);
-	glAttachShader(shaderProgram1, fragmentShader1);
-	glBindAttribLocation(shaderProgram1, 0, "vertexPosition");
-	glBindAttribLocation(shaderProgram1, 1, "vertexColor");
-	glBindFragDataLocation(shaderProgram1, 0, "fragmentColor");
-	glLinkProgram(shaderProgram1);
-	checkLinking(shaderProgram1);
+
+	static const char* texturedAttributes[] = { "vertexPosition", "vertexTexCoord" };
+	texturedShader.Create("textured quad", vertexSource0, fragmentSource0, texturedAttributes, 2);
+
+	static const char* coloredAttributes[] = { "vertexPosition", "vertexColor" };
+	coloredShader.Create("colored quad", vertexSource1, fragmentSource1, coloredAttributes, 2);
+
+	if (instancingSupported)
+	{
+		// instanced quads share fragment shader 0
+		static const char* instancedAttributes[] = { "vertexPosition", "vertexTexCoord",
+			"instanceAxes", "instanceOrigin", "instanceRect" };
+		instancedShader.Create("instanced quad", vertexSource3, fragmentSource0, instancedAttributes, 5);
+	}
+	glBackend.Initialize();
 
 	scene.Initialize();
 
@@ -964,36 +4299,74 @@ void onMouseButton(int button, int state, int x, int y)
 		mouseY = y;
 		mouseClicked = false;
 	}
-	glutPostRedisplay();
+	pacer.Invalidate();
 }
 
 void onKeyboard(unsigned char key, int x, int y)
 {
+	if (key == 'p') profiler.Write(profiler.tracePath ? profiler.tracePath : "trace.json");
+	if (key == 'o') overlay.visible = !overlay.visible;
 	keyPressed[key] = true;
 	keyDown = true;
-	glutPostRedisplay();
+	pacer.Invalidate();
 }
 
 void onKeyboardUp(unsigned char key, int x, int y)
 {
 	keyPressed[key] = false;
 	keyDown = false;
-	glutPostRedisplay();
+	pacer.Invalidate();
 }
 
 void onExit() {
-	glDeleteProgram(shaderProgram0);
+	static bool exited = false;
+	if (exited) return;
+	exited = true;
+
+	ReportLatencies();
+	if (profiler.tracePath) profiler.Write(profiler.tracePath);
+	// the context is gone by the time global destructors run
+	scene.Clear();
+	textureManager.Shutdown();
+	glBackend.Shutdown();
+	texturedShader.Destroy();
+	coloredShader.Destroy();
+	instancedShader.Destroy();
+	if (glState.frames > 0)
+	{
+		printf("GL state cache: %.1f of %.1f state calls skipped per frame\n",
+			(double)glState.totalSkipped / glState.frames,
+			(double)(glState.totalIssued + glState.totalSkipped) / glState.frames);
+	}
 	printf("exit");
 }
 
 void onDisplay() {
+	PROFILE_SCOPE("onDisplay");
 
+	pacer.BeginFrame();
 	glClearColor(0, 0, 0, 0);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+	renderer->drawCalls = 0;
 	scene.Draw();
+	pacer.EndDraw();
+	// the first frame has no previous one to measure from
+	static bool firstFrame = true;
+	static std::chrono::steady_clock::time_point lastFrame;
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	double frameMs = firstFrame ? 0 : Milliseconds(now - lastFrame);
+	lastFrame = now;
+	if (!firstFrame) frameTimes.Record(frameMs);
+	firstFrame = false;
+	overlay.Frame(frameMs, renderer->drawCalls, pacer.lastGpuMs);
 
-	glutSwapBuffers();
+	{
+		PROFILE_SCOPE("glutSwapBuffers");
+		glutSwapBuffers();
+	}
+	glState.EndFrame();
+	pacer.EndFrame();
 }
 
 void onReshape(int winWidth0, int winHeight0)
@@ -1001,28 +4374,118 @@ void onReshape(int winWidth0, int winHeight0)
 	glViewport(0, 0, winWidth0, winHeight0);
 
 	windowWidth = winWidth0, windowHeight = winHeight0;
+	view = ViewTransform();
+	pacer.Invalidate();
 }
 
 
 void onIdle() {
-	double t = glutGet(GLUT_ELAPSED_TIME) * 0.001;
-	static double lastTime = 0.0;
-	double dt = t - lastTime;
-	lastTime = t;
-
-	scene.Interact();
-	scene.Control();
-	scene.Move(dt);
-	scene.Draw();
+	if (interrupted)
+	{
+		onExit();
+		exit(0);
+	}
+
+	static std::chrono::steady_clock::time_point lastTime = std::chrono::steady_clock::now();
+	static double accumulator = 0.0;
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	double dt = std::chrono::duration<double>(now - lastTime).count();
+	lastTime = now;
+
+	// after a long stall (window drag, breakpoint) drop the backlog instead of
+	// trying to catch up with hundreds of ticks
+	if (dt > 0.25) dt = 0.25;
+	accumulator += dt;
+
+	double tick = 1.0 / tickRate;
+	while (accumulator >= tick)
+	{
+		if (scene.Tick(tick)) pacer.Invalidate();
+		simulationTime += tick;
+		accumulator -= tick;
+	}
+	// a lazy pacer only draws after ticks, so show the latest state as is
+	renderAlpha = pacer.lazy ? 1.0f : (float)(accumulator / tick);
+
+	if (pacer.FrameDue())
+	{
+		glutPostRedisplay();
+		return;
+	}
 
-	glutPostRedisplay();
+	// nothing to do until the next tick or frame, give the CPU back
+	double wait = tick - accumulator;
+	if (pacer.targetFps > 0 && pacer.SecondsUntilDue() < wait) wait = pacer.SecondsUntilDue();
+	if (wait > 0.002)
+	{
+		PROFILE_SCOPE("idle sleep");
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
 }
 
 
 int main(int argc, char * argv[]) {
+	FindExecutableDir(argc > 0 ? argv[0] : 0);
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--pack-assets") == 0) return PackAssets(i + 1 < argc ? argv[i + 1] : ".");
+		if (strcmp(argv[i], "--bench-broadphase") == 0) { BenchmarkBroadphase(); return 0; }
+		if (strcmp(argv[i], "--bench-kernels") == 0) { BenchmarkKernels(); return 0; }
+	}
+	bool allowInstancing = true;
+	bool benchDispatch = false;
+	bool looseAssets = false;
+	int headlessTicks = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc) headlessTicks = atoi(argv[++i]);
+		if (strcmp(argv[i], "--bench-dispatch") == 0) benchDispatch = true;
+		if (strcmp(argv[i], "--fireballs") == 0 && i + 1 < argc) fireballCount = atoi(argv[++i]);
+		if (strcmp(argv[i], "--diamonds") == 0 && i + 1 < argc) diamondCount = atoi(argv[++i]);
+		if (strcmp(argv[i], "--no-instancing") == 0) allowInstancing = false;
+		if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc)
+		{
+			const char* name = argv[++i];
+			for (int level = 0; level <= SimdLevel(); level++)
+				if (strcmp(name, simdNames[level]) == 0) moveKernel = MoveKernelFor(level);
+		}
+		if (strcmp(argv[i], "--tick-rate") == 0 && i + 1 < argc) tickRate = atof(argv[++i]);
+		if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) pacer.targetFps = atof(argv[++i]);
+		if (strcmp(argv[i], "--vsync") == 0) pacer.vsync = 1;
+		if (strcmp(argv[i], "--no-vsync") == 0) pacer.vsync = 0;
+		if (strcmp(argv[i], "--lazy-redraw") == 0) pacer.lazy = true;
+		if (strcmp(argv[i], "--frame-stats") == 0) pacer.report = true;
+		if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) profiler.tracePath = argv[++i];
+		if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) csvPath = argv[++i];
+		if (strcmp(argv[i], "--decode-threads") == 0 && i + 1 < argc) decodeThreads = atoi(argv[++i]);
+		if (strcmp(argv[i], "--no-texture-cache") == 0) textureCacheEnabled = false;
+		if (strcmp(argv[i], "--loose-assets") == 0) looseAssets = true;
+		if (strcmp(argv[i], "--upload-budget") == 0 && i + 1 < argc) uploadBudget = atoi(argv[++i]) * 1024;
+	}
+	if (!looseAssets && assets.Open(executableDir + assetArchiveName))
+		printf("assets: %d images mapped from %s\n", assets.Count(), (executableDir + assetArchiveName).c_str());
+	textureCacheDir = executableDir + "texcache";
+	if (tickRate <= 0) tickRate = 60;
+	if (decodeThreads <= 0) decodeThreads = (int)std::thread::hardware_concurrency();
+	if (decodeThreads > 1) threadPool.Start(decodeThreads);
+	signal(SIGINT, OnInterrupt);
+
+	if (benchDispatch)
+	{
+		BenchmarkDispatch();
+		return 0;
+	}
+	if (headlessTicks > 0)
+	{
+		RunHeadless(headlessTicks);
+		return 0;
+	}
+
 	glutInit(&argc, argv);
 #if !defined(__APPLE__)
 	glutInitContextVersion(majorVersion, minorVersion);
+	// closing the window would otherwise end the process inside glutMainLoop
+	glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
 #endif
 	glutInitWindowSize(windowWidth, windowHeight);
 	glutInitWindowPosition(10, 10);
@@ -1045,7 +4508,9 @@ int main(int argc, char * argv[]) {
 	glGetIntegerv(GL_MINOR_VERSION, &minorVersion);
 	printf("GL Version (integer) : %d.%d\n", majorVersion, minorVersion);
 	printf("GLSL Version : %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+	instancingSupported = allowInstancing && (majorVersion > 3 || (majorVersion == 3 && minorVersion >= 3));
 
+	pacer.Initialize(majorVersion > 3 || (majorVersion == 3 && minorVersion >= 3));
 	onInitialization();
 
 	glutDisplayFunc(onDisplay);
@@ -1054,6 +4519,9 @@ int main(int argc, char * argv[]) {
 	glutKeyboardUpFunc(onKeyboardUp);
 	glutIdleFunc(onIdle);
 	glutMouseFunc(onMouseButton);
+#if !defined(__APPLE__)
+	glutCloseFunc(onExit);	// while the GL context is still there
+#endif
 
 	glutMainLoop();
 	onExit();